@@ -0,0 +1,488 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signal.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "event2/buffer.h"
+#include "event2/bufferevent.h"
+#include "event2/event.h"
+#include "event2/util.h"
+
+#include "histogram.h"
+
+// Load generator for main. Opens a number of connections to one of its ports
+// and sends fixed size messages, either as fast as the replies come back or at
+// a fixed rate. Against a server running with --echo every message is timed
+// until its echo has been read back in full.
+struct bench_config_t {
+    const char *host;
+    int port;
+    int num_conns;
+    size_t msg_size;
+    double rate;
+    int pipeline;
+    int duration_s;
+    int no_echo;
+};
+
+struct bench_config_t config = {
+    .host = "127.0.0.1",
+    .port = 8888,
+    .num_conns = 10,
+    .msg_size = 64,
+    .rate = 0,
+    .pipeline = 1,
+    .duration_s = 10,
+    .no_echo = 0,
+};
+
+struct bench_conn_t {
+    struct bufferevent *bev;
+    struct event *event_send;
+    uint64_t connect_start_ns;
+    int connected;
+
+    // Send times of the messages whose echo hasn't come back yet, oldest first
+    uint64_t *inflight;
+    size_t inflight_cap;
+    size_t inflight_head;
+    size_t inflight_len;
+
+    // When the next message should go out in fixed rate mode
+    uint64_t next_send_ns;
+};
+
+struct bench_t {
+    struct event_base *base;
+    struct sockaddr_storage addr;
+    int addr_len;
+
+    char *msg;
+    uint64_t interval_ns;
+    int running;
+
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t last_connect_ns;
+
+    int conns_ok;
+    int conns_failed;
+    int conns_dropped;  // given up on by the benchmark itself
+    uint64_t msgs_sent;
+    uint64_t msgs_received;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+
+    struct histogram_t latency;
+    struct histogram_t connect_latency;
+};
+
+struct bench_t bench;
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int inflight_push(struct bench_conn_t *conn, uint64_t ts) {
+    if (conn->inflight_len == conn->inflight_cap) {
+        size_t cap = conn->inflight_cap ? conn->inflight_cap * 2 : 16;
+        uint64_t *inflight = malloc(cap * sizeof(uint64_t));
+        if (inflight == NULL) {
+            perror("Failed to malloc inflight queue\n");
+            return -1;
+        }
+        for (size_t i = 0; i < conn->inflight_len; ++i) {
+            inflight[i] = conn->inflight[(conn->inflight_head + i) % conn->inflight_cap];
+        }
+        free(conn->inflight);
+        conn->inflight = inflight;
+        conn->inflight_cap = cap;
+        conn->inflight_head = 0;
+    }
+
+    conn->inflight[(conn->inflight_head + conn->inflight_len) % conn->inflight_cap] = ts;
+    conn->inflight_len++;
+    return 0;
+}
+
+uint64_t inflight_pop(struct bench_conn_t *conn) {
+    uint64_t ts = conn->inflight[conn->inflight_head];
+    conn->inflight_head = (conn->inflight_head + 1) % conn->inflight_cap;
+    conn->inflight_len--;
+    return ts;
+}
+
+// Stop sending on a connection and stop listening to it
+void stop_conn(struct bench_conn_t *conn) {
+    event_del(conn->event_send);
+    bufferevent_disable(conn->bev, EV_READ | EV_WRITE);
+}
+
+// Queue up one message. The payload is shared by all messages, so it is added
+// by reference rather than copied. Returns -1 if its send time couldn't be
+// kept, in which case the echo couldn't be matched up either and the
+// connection is dropped.
+int send_msg(struct bench_conn_t *conn, uint64_t send_ns) {
+    if (!config.no_echo && inflight_push(conn, send_ns) < 0) {
+        stop_conn(conn);
+        bench.conns_dropped++;
+        return -1;
+    }
+    struct evbuffer *output = bufferevent_get_output(conn->bev);
+    evbuffer_add_reference(output, bench.msg, config.msg_size, NULL, NULL);
+
+    bench.msgs_sent++;
+    bench.bytes_sent += config.msg_size;
+    return 0;
+}
+
+// In fixed rate mode, latency is measured from when a message should have been
+// sent rather than when it actually was. That way a stalled server shows up in
+// the results instead of silently slowing the benchmark down (coordinated
+// omission).
+void cb_send(evutil_socket_t fd, short what, void *arg) {
+    struct bench_conn_t *conn = arg;
+    if (!bench.running) {
+        return;
+    }
+
+    uint64_t now = now_ns();
+    while (conn->next_send_ns <= now) {
+        if (send_msg(conn, conn->next_send_ns) < 0) {
+            return;
+        }
+        conn->next_send_ns += bench.interval_ns;
+    }
+}
+
+void cb_read(struct bufferevent *bev, void *arg) {
+    struct bench_conn_t *conn = arg;
+    struct evbuffer *input = bufferevent_get_input(bev);
+    size_t len = evbuffer_get_length(input);
+
+    if (!bench.running) {
+        evbuffer_drain(input, len);
+        return;
+    }
+    bench.bytes_received += len;
+
+    if (config.no_echo) {
+        evbuffer_drain(input, len);
+        return;
+    }
+
+    // Every msg_size bytes that come back complete the oldest message in flight
+    uint64_t now = now_ns();
+    size_t complete = len / config.msg_size;
+    for (size_t i = 0; i < complete && conn->inflight_len > 0; ++i) {
+        hist_record(&bench.latency, now - inflight_pop(conn));
+        bench.msgs_received++;
+
+        if (config.rate == 0 && send_msg(conn, now) < 0) {
+            return;
+        }
+    }
+    evbuffer_drain(input, complete * config.msg_size);
+}
+
+// Without echoes to wait for, keep the output buffer topped up instead
+void cb_write(struct bufferevent *bev, void *arg) {
+    struct bench_conn_t *conn = arg;
+    if (!bench.running || !config.no_echo || config.rate > 0) {
+        return;
+    }
+
+    struct evbuffer *output = bufferevent_get_output(bev);
+    while (evbuffer_get_length(output) < 64 * 1024) {
+        send_msg(conn, 0);
+    }
+}
+
+void cb_event(struct bufferevent *bev, short events, void *arg) {
+    struct bench_conn_t *conn = arg;
+
+    if (events & BEV_EVENT_CONNECTED) {
+        uint64_t now = now_ns();
+        conn->connected = 1;
+        bench.conns_ok++;
+        bench.last_connect_ns = now;
+        hist_record(&bench.connect_latency, now - conn->connect_start_ns);
+
+        // Small messages shouldn't sit in the socket waiting for Nagle
+        int enabled = 1;
+        setsockopt(bufferevent_getfd(bev), IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+
+        if (config.rate > 0) {
+            conn->next_send_ns = now;
+            struct timeval tv = {0, bench.interval_ns / 1000};
+            if (tv.tv_usec == 0) {
+                tv.tv_usec = 1;
+            }
+            while (tv.tv_usec >= 1000000) {
+                tv.tv_sec++;
+                tv.tv_usec -= 1000000;
+            }
+            event_add(conn->event_send, &tv);
+            cb_send(-1, EV_TIMEOUT, conn);
+        } else if (config.no_echo) {
+            cb_write(bev, conn);
+        } else {
+            for (int i = 0; i < config.pipeline; ++i) {
+                if (send_msg(conn, now) < 0) {
+                    break;
+                }
+            }
+        }
+        return;
+    }
+
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        if (!conn->connected) {
+            bench.conns_failed++;
+        } else if (bench.running) {
+            fprintf(stderr, "Connection closed by server\n");
+        }
+        stop_conn(conn);
+    }
+}
+
+void cb_done(evutil_socket_t fd, short what, void *arg) {
+    bench.running = 0;
+    bench.end_ns = now_ns();
+    event_base_loopbreak(bench.base);
+}
+
+void cb_sigint(evutil_socket_t fd, short what, void *arg) {
+    cb_done(fd, what, arg);
+}
+
+void print_report() {
+    double elapsed_s = (bench.end_ns - bench.start_ns) / 1e9;
+    double setup_s = (bench.last_connect_ns - bench.start_ns) / 1e9;
+
+    printf("Target: %s:%d, %d connections, %zu byte messages, ",
+           config.host, config.port, config.num_conns, config.msg_size);
+    if (config.rate > 0) {
+        printf("%.0f msgs/s", config.rate);
+    } else if (config.no_echo) {
+        printf("unlimited rate");
+    } else {
+        printf("closed loop with %d in flight per connection", config.pipeline);
+    }
+    printf(", %.2f s\n\n", elapsed_s);
+
+    printf("Connections: %d established, %d failed", bench.conns_ok, bench.conns_failed);
+    if (bench.conns_dropped > 0) {
+        printf(", %d dropped", bench.conns_dropped);
+    }
+    if (bench.conns_ok > 0 && setup_s > 0) {
+        printf(", %.1f conn/s", bench.conns_ok / setup_s);
+    }
+    printf("\n");
+    printf("  connect latency (us): p50 %.1f, p99 %.1f, max %.1f\n\n",
+           hist_percentile(&bench.connect_latency, 50) / 1e3,
+           hist_percentile(&bench.connect_latency, 99) / 1e3,
+           bench.connect_latency.max / 1e3);
+
+    printf("Throughput: %.1f msgs/s sent, %.2f MiB/s sent, %.2f MiB/s received\n",
+           bench.msgs_sent / elapsed_s,
+           bench.bytes_sent / elapsed_s / (1024 * 1024),
+           bench.bytes_received / elapsed_s / (1024 * 1024));
+
+    if (config.no_echo) {
+        return;
+    }
+
+    printf("            %.1f msgs/s echoed\n\n", bench.msgs_received / elapsed_s);
+    printf("Latency (us): p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n\n",
+           hist_percentile(&bench.latency, 50) / 1e3,
+           hist_percentile(&bench.latency, 90) / 1e3,
+           hist_percentile(&bench.latency, 99) / 1e3,
+           hist_percentile(&bench.latency, 99.9) / 1e3,
+           bench.latency.max / 1e3);
+    hist_print_distribution(&bench.latency, stdout, 1e3);
+}
+
+void usage(const char *prog) {
+    printf(
+        "Usage: %s [options]\n"
+        "  -H, --host ADDR       server address (default: 127.0.0.1)\n"
+        "  -p, --port N          server port, 8888 or 7777 (default: 8888)\n"
+        "  -c, --connections N   concurrent connections (default: 10)\n"
+        "  -s, --size N          message size in bytes (default: 64)\n"
+        "  -r, --rate N          total messages per second across all connections,\n"
+        "                        0 to send as fast as replies come back (default: 0)\n"
+        "  -P, --pipeline N      messages in flight per connection when not rate\n"
+        "                        limited (default: 1)\n"
+        "  -d, --duration N      run for N seconds (default: 10)\n"
+        "  -n, --no-echo         don't wait for echoes, just measure throughput\n"
+        "  -h, --help            show this help\n"
+        "\n"
+        "Latency is only measured against a server running with --echo.\n",
+        prog
+    );
+}
+
+int parse_args(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"host",        required_argument, NULL, 'H'},
+        {"port",        required_argument, NULL, 'p'},
+        {"connections", required_argument, NULL, 'c'},
+        {"size",        required_argument, NULL, 's'},
+        {"rate",        required_argument, NULL, 'r'},
+        {"pipeline",    required_argument, NULL, 'P'},
+        {"duration",    required_argument, NULL, 'd'},
+        {"no-echo",     no_argument,       NULL, 'n'},
+        {"help",        no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:c:s:r:P:d:nh", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'H':
+            config.host = optarg;
+            break;
+        case 'p':
+            config.port = atoi(optarg);
+            break;
+        case 'c':
+            config.num_conns = atoi(optarg);
+            break;
+        case 's':
+            config.msg_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            config.rate = atof(optarg);
+            break;
+        case 'P':
+            config.pipeline = atoi(optarg);
+            break;
+        case 'd':
+            config.duration_s = atoi(optarg);
+            break;
+        case 'n':
+            config.no_echo = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (config.port < 1 || config.num_conns < 1 || config.msg_size < 1 ||
+            config.rate < 0 || config.pipeline < 1 || config.duration_s < 1) {
+        fprintf(stderr, "Invalid arguments\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (parse_args(argc, argv) < 0) {
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char addr_port[128];
+    snprintf(addr_port, sizeof(addr_port), "%s:%d", config.host, config.port);
+    bench.addr_len = sizeof(bench.addr);
+    if (evutil_parse_sockaddr_port(addr_port, (struct sockaddr*) &bench.addr,
+                                   &bench.addr_len) < 0) {
+        fprintf(stderr, "Invalid address: %s\n", addr_port);
+        return 1;
+    }
+
+    // Pacing sends in fixed rate mode needs better than the default millisecond
+    // timer resolution
+    struct event_config *cfg = event_config_new();
+    event_config_set_flag(cfg, EVENT_BASE_FLAG_PRECISE_TIMER);
+    bench.base = event_base_new_with_config(cfg);
+    event_config_free(cfg);
+    if (!bench.base) {
+        perror("Failed to create event base\n");
+        return 1;
+    }
+
+    bench.msg = malloc(config.msg_size);
+    if (bench.msg == NULL) {
+        perror("Failed to malloc message\n");
+        return 1;
+    }
+    memset(bench.msg, 'x', config.msg_size);
+
+    if (config.rate > 0) {
+        bench.interval_ns = (uint64_t) (1e9 * config.num_conns / config.rate);
+    }
+    hist_init(&bench.latency);
+    hist_init(&bench.connect_latency);
+
+    struct bench_conn_t *conns = calloc(config.num_conns, sizeof(struct bench_conn_t));
+    if (conns == NULL) {
+        perror("Failed to calloc connections\n");
+        return 1;
+    }
+
+    bench.running = 1;
+    bench.start_ns = now_ns();
+
+    for (int i = 0; i < config.num_conns; ++i) {
+        struct bench_conn_t *conn = &conns[i];
+
+        conn->bev = bufferevent_socket_new(bench.base, -1, BEV_OPT_CLOSE_ON_FREE);
+        conn->event_send = event_new(bench.base, -1, EV_PERSIST, cb_send, conn);
+        if (conn->bev == NULL || conn->event_send == NULL) {
+            perror("Failed to create connection\n");
+            return 1;
+        }
+
+        bufferevent_setcb(conn->bev, cb_read, cb_write, cb_event, conn);
+        bufferevent_enable(conn->bev, EV_READ | EV_WRITE);
+
+        conn->connect_start_ns = now_ns();
+        if (bufferevent_socket_connect(conn->bev, (struct sockaddr*) &bench.addr,
+                                       bench.addr_len) < 0) {
+            bench.conns_failed++;
+        }
+    }
+
+    struct timeval duration = {config.duration_s, 0};
+    struct event *event_done = evtimer_new(bench.base, cb_done, NULL);
+    evtimer_add(event_done, &duration);
+
+    struct event *event_sigint = evsignal_new(bench.base, SIGINT, cb_sigint, NULL);
+    evsignal_add(event_sigint, NULL);
+
+    event_base_dispatch(bench.base);
+    if (bench.running) {
+        bench.running = 0;
+        bench.end_ns = now_ns();
+    }
+
+    print_report();
+
+    for (int i = 0; i < config.num_conns; ++i) {
+        event_free(conns[i].event_send);
+        bufferevent_free(conns[i].bev);
+        free(conns[i].inflight);
+    }
+    free(conns);
+    free(bench.msg);
+    event_free(event_done);
+    event_free(event_sigint);
+    event_base_free(bench.base);
+
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "evstream.h"
+
+// Prints the records of an event log written by main --event-log, oldest
+// first, one line each. The file can be read while the server is still
+// writing it; records the writer is overwriting at the same time may come
+// out garbled.
+const char *KIND_NAMES[] = {"?", "accept", "read", "close"};
+const char *REASON_NAMES[] = {"closed", "disconnected", "timed out"};
+
+struct decode_config_t {
+    const char *path;
+    uint64_t last;  // only the last N records, 0 for all of them
+};
+
+struct decode_config_t config;
+
+void print_record(const struct evstream_record_t *rec) {
+    char when[32];
+    time_t secs = rec->time_ns / 1000000000;
+    struct tm tm;
+    gmtime_r(&secs, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    char addr[INET6_ADDRSTRLEN] = "unix";
+    if (rec->family == AF_INET || rec->family == AF_INET6) {
+        inet_ntop(rec->family, rec->addr, addr, sizeof(addr));
+    }
+    const char *kind = rec->kind <= EVSTREAM_CLOSE ? KIND_NAMES[rec->kind] : KIND_NAMES[0];
+
+    printf("%s.%06luZ w%u #%lu %-6s %s %s%s%s:%u", when,
+           (unsigned long) (rec->time_ns % 1000000000) / 1000, rec->worker,
+           (unsigned long) (rec->conn_id & ((1ull << 56) - 1)), kind,
+           rec->listener == 0 ? "raw" : "lev", rec->family == AF_INET6 ? "[" : "", addr,
+           rec->family == AF_INET6 ? "]" : "", rec->port);
+
+    switch (rec->kind) {
+    case EVSTREAM_READ:
+        printf(" %lu bytes in %u reads over %.3fs", (unsigned long) rec->bytes, rec->reads,
+               rec->duration_us / 1e6);
+        break;
+    case EVSTREAM_CLOSE:
+        printf(" %s after %.3fs, %lu bytes in %u reads",
+               rec->reason <= EVSTREAM_TIMED_OUT ? REASON_NAMES[rec->reason] : "?",
+               rec->duration_us / 1e6, (unsigned long) rec->bytes, rec->reads);
+        break;
+    }
+    printf("\n");
+}
+
+void usage(const char *prog) {
+    printf(
+        "Usage: %s [options] FILE\n"
+        "  -n, --last N      only print the last N records\n"
+        "  -h, --help        show this help\n",
+        prog
+    );
+}
+
+int parse_args(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"last",          required_argument, NULL, 'n'},
+        {"help",          no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            config.last = strtoull(optarg, NULL, 10);
+            if (config.last == 0) {
+                fprintf(stderr, "Invalid number of records: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return -1;
+    }
+    config.path = argv[optind];
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (parse_args(argc, argv) < 0) {
+        return 1;
+    }
+
+    int fd = open(config.path, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open event log\n");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("Failed to stat event log\n");
+        return 1;
+    }
+    if ((size_t) st.st_size < EVSTREAM_HEADER_SIZE) {
+        fprintf(stderr, "%s is too short to be an event log\n", config.path);
+        return 1;
+    }
+    const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to mmap event log\n");
+        return 1;
+    }
+
+    const struct evstream_header_t *header = (const void*) map;
+    if (header->magic != EVSTREAM_MAGIC || header->version != EVSTREAM_VERSION ||
+        header->record_size != sizeof(struct evstream_record_t) ||
+        EVSTREAM_HEADER_SIZE + header->capacity * header->record_size > (uint64_t) st.st_size) {
+        fprintf(stderr, "%s is not an event log this version can read\n", config.path);
+        return 1;
+    }
+
+    // Once the ring has wrapped, the oldest record left is count - capacity
+    const struct evstream_record_t *records = (const void*) (map + EVSTREAM_HEADER_SIZE);
+    uint64_t count = __atomic_load_n(&header->count, __ATOMIC_ACQUIRE);
+    uint64_t first = count > header->capacity ? count - header->capacity : 0;
+    if (config.last && count - first > config.last) {
+        first = count - config.last;
+    }
+    for (uint64_t i = first; i < count; ++i) {
+        print_record(&records[i % header->capacity]);
+    }
+
+    munmap((void*) map, st.st_size);
+    close(fd);
+    return 0;
+}
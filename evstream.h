@@ -0,0 +1,56 @@
+#ifndef EVSTREAM_H
+#define EVSTREAM_H
+
+#include <stdint.h>
+
+// The connection event stream that main writes with --event-log, and
+// evdecode reads. The file is a header followed by a ring of fixed size
+// records. The header's count is how many records have ever been written;
+// record i is at index i % capacity, so once the ring has wrapped the oldest
+// one still there is record count - capacity. All fields are in host byte
+// order, except addr which holds the address as it came from the socket.
+#define EVSTREAM_MAGIC 0x314d525453564545ull   // "EEVSTRM1"
+#define EVSTREAM_VERSION 1
+
+enum evstream_kind_t {
+    EVSTREAM_ACCEPT = 1,
+    EVSTREAM_READ,      // what was read since the connection's last record
+    EVSTREAM_CLOSE,     // totals over the connection's lifetime
+};
+
+enum evstream_reason_t {
+    EVSTREAM_CLOSED,        // by the server: handler, drained, shutdown
+    EVSTREAM_DISCONNECTED,  // by the peer, or a socket error
+    EVSTREAM_TIMED_OUT,
+};
+
+// Records start this far into the file, so each one is cache line aligned
+#define EVSTREAM_HEADER_SIZE 64
+
+struct evstream_header_t {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;
+    uint64_t count;
+};
+
+struct evstream_record_t {
+    uint64_t time_ns;       // CLOCK_REALTIME
+    uint64_t conn_id;       // worker id in the top byte, then a sequence number
+    uint64_t bytes;
+    uint64_t duration_us;   // since the last record (read) or accept (close)
+    uint32_t reads;
+    uint8_t kind;
+    uint8_t listener;       // 0 for the raw listeners, 1 for bufferevents
+    uint8_t family;         // AF_INET, AF_INET6 or AF_UNIX
+    uint8_t reason;         // for EVSTREAM_CLOSE
+    uint8_t addr[16];
+    uint16_t port;
+    uint16_t worker;
+    uint32_t pad;
+};
+
+_Static_assert(sizeof(struct evstream_record_t) == 64, "records are one cache line");
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// A log-linear histogram in the style of HdrHistogram. Values below
+// HIST_SUB_COUNT get a bucket each, and every power of two above that is split
+// into HIST_SUB_COUNT / 2 linear buckets, which keeps the recorded value within
+// 1/64th (~1.6%) of the real one over the whole uint64_t range.
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT (HIST_SUB_COUNT / 2)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_HALF_COUNT + HIST_HALF_COUNT)
+
+struct histogram_t {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+    double sum_squares;
+};
+
+static inline void hist_init(struct histogram_t *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+static inline int hist_index(uint64_t value) {
+    if (value < HIST_SUB_COUNT) {
+        return value;
+    }
+    // Keep the top HIST_SUB_BITS - 1 bits below the leading one
+    int shift = (63 - __builtin_clzll(value)) - (HIST_SUB_BITS - 1);
+    return shift * HIST_HALF_COUNT + (value >> shift);
+}
+
+// The smallest and largest values that end up in a bucket
+static inline uint64_t hist_bucket_low(int index) {
+    if (index < HIST_SUB_COUNT) {
+        return index;
+    }
+    int shift = index / HIST_HALF_COUNT - 1;
+    return (uint64_t) (index - shift * HIST_HALF_COUNT) << shift;
+}
+
+static inline uint64_t hist_bucket_high(int index) {
+    if (index < HIST_SUB_COUNT) {
+        return index;
+    }
+    int shift = index / HIST_HALF_COUNT - 1;
+    return hist_bucket_low(index) + ((uint64_t) 1 << shift) - 1;
+}
+
+static inline void hist_record(struct histogram_t *h, uint64_t value) {
+    h->counts[hist_index(value)]++;
+    h->total++;
+    h->sum += value;
+    h->sum_squares += (double) value * value;
+    if (value < h->min) {
+        h->min = value;
+    }
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+static inline void hist_merge(struct histogram_t *into, const struct histogram_t *from) {
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    into->sum_squares += from->sum_squares;
+    if (from->min < into->min) {
+        into->min = from->min;
+    }
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+// The highest value that is equivalent to the one at the given percentile,
+// like HdrHistogram reports it
+static inline uint64_t hist_percentile(const struct histogram_t *h, double percentile) {
+    if (h->total == 0) {
+        return 0;
+    }
+
+    uint64_t wanted = (uint64_t) ceil(percentile / 100.0 * h->total);
+    if (wanted < 1) {
+        wanted = 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->counts[i];
+        if (seen >= wanted) {
+            uint64_t high = hist_bucket_high(i);
+            return high < h->max ? high : h->max;
+        }
+    }
+    return h->max;
+}
+
+// How many recorded values are equivalent to or lower than value
+static inline uint64_t hist_count_below(const struct histogram_t *h, uint64_t value) {
+    uint64_t seen = 0;
+    int last = hist_index(value);
+    for (int i = 0; i <= last; ++i) {
+        seen += h->counts[i];
+    }
+    return seen;
+}
+
+static inline double hist_mean(const struct histogram_t *h) {
+    return h->total ? h->sum / h->total : 0;
+}
+
+static inline double hist_stddev(const struct histogram_t *h) {
+    if (h->total == 0) {
+        return 0;
+    }
+    double mean = hist_mean(h);
+    double variance = h->sum_squares / h->total - mean * mean;
+    return variance > 0 ? sqrt(variance) : 0;
+}
+
+// Print a percentile distribution the way HdrHistogram's outputPercentileDistribution
+// does, with values divided by scale (e.g. 1000 to print nanoseconds as
+// microseconds)
+static inline void hist_print_distribution(const struct histogram_t *h, FILE *out,
+                                           double scale) {
+    const int ticks_per_half_distance = 5;
+
+    fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount",
+            "1/(1-Percentile)");
+
+    for (double percentile = 0; h->total > 0; ) {
+        uint64_t value = hist_percentile(h, percentile);
+        uint64_t seen = hist_count_below(h, value);
+        fprintf(out, "%12.3f %14.12f %10lu %14.2f\n", value / scale, percentile / 100.0,
+                (unsigned long) seen, 1.0 / (1.0 - percentile / 100.0));
+
+        if (seen >= h->total) {
+            fprintf(out, "%12.3f %14.12f %10lu\n", h->max / scale, 1.0,
+                    (unsigned long) h->total);
+            break;
+        }
+
+        // Halve the distance to 100% every ticks_per_half_distance lines
+        int ticks = ticks_per_half_distance *
+            (int) pow(2, floor(log2(100.0 / (100.0 - percentile))) + 1);
+        percentile += 100.0 / ticks;
+    }
+
+    fprintf(out, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n",
+            hist_mean(h) / scale, hist_stddev(h) / scale);
+    fprintf(out, "#[Max     = %12.3f, Total count    = %12lu]\n",
+            h->max / scale, (unsigned long) h->total);
+}
+
+#endif
@@ -1,226 +1,5672 @@
+#define _GNU_SOURCE // for accept4
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/signal.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event2/buffer.h"
+#include "event2/bufferevent.h"
+#include "event2/bufferevent_ssl.h"
+#include "event2/event.h"
+#include "event2/event_struct.h"
+#include "event2/http.h"
+#include "event2/listener.h"
+#include "event2/thread.h"
+
+#include "evstream.h"
+#include "trace.h"
+
+// How often cb_timer runs, from --stats-interval
+struct timeval TIMEOUT_S = {30, 0};
+
+// Each level includes the ones before it
+enum log_level_t {
+    LOG_OFF,
+    LOG_INFO,       // startup, shutdown, connects and disconnects
+    LOG_DEBUG,      // one line per read
+    LOG_HEXDUMP,    // ...followed by the first bytes that were read
+};
+
+const char *LOG_LEVEL_NAMES[] = {"off", "info", "debug", "hexdump"};
+
+// How messages on :7777 are delimited
+enum framing_t {
+    FRAMING_NONE,   // whatever each read returns
+    FRAMING_LINE,   // newline terminated
+    FRAMING_LENGTH, // 4 byte big endian length, then that many bytes
+};
+
+const char *FRAMING_NAMES[] = {"none", "line", "length"};
+
+#define FRAME_HEADER_LEN 4
+
+// Event priorities, lower runs first. libevent only runs the callbacks of the
+// most urgent non-empty queue per loop iteration, so listeners and control
+// events get through even while thousands of connections are readable.
+// The evconnlistener on :7777 has no priority setter and stays on the default.
+enum priority_t {
+    PRIO_CONTROL,   // listeners, signals, timers
+    PRIO_DEFAULT,   // what libevent gives everything else
+    PRIO_CONN,      // per-connection reads and writes
+    NUM_PRIORITIES,
+};
+
+// An address to listen on, as given with --raw-listen or --lev-listen
+#define MAX_LISTEN_ADDRS 8
+
+struct listen_addr_t {
+    char text[128];     // a copy, so it outlives the config file's text
+    struct sockaddr_storage ss;
+    socklen_t len;
+    int v6only;     // an IPv4 address on the same port is in the list too
+};
+
+struct config_t {
+    int num_threads;
+    size_t read_buf_size;
+    int read_budget;
+    enum log_level_t log_level;
+    int log_rate_limit;
+    int backlog;
+    int accept_batch;
+
+    // TCP options, 0 leaves the system default
+    int nodelay;
+    int rcvbuf;
+    int sndbuf;
+    int defer_accept_s;
+    int quickack;
+    int fastopen_qlen;
+    int busy_poll_us;
+    int keepalive_idle_s;
+    int keepalive_intvl_s;
+    int keepalive_cnt;
+    int echo;
+    size_t write_high_wm;
+    size_t write_low_wm;
+    int idle_timeout_s;
+    int timer_wheel;
+    const char *event_log;
+    size_t event_log_size;
+    int grace_period_s;
+    size_t max_conns;
+    int max_conns_per_ip;
+    size_t rate_limit;
+    size_t rate_burst;
+    size_t global_rate_limit;
+    const char *tls_cert;
+    const char *tls_key;
+    long tls_cache_size;
+    int admin_port;
+    enum framing_t framing;
+    size_t max_frame_size;
+    int lev_priority;
+    int lev_bev_options;    // BEV_OPT_* on top of BEV_OPT_CLOSE_ON_FREE
+    int acceptor_thread;
+    int io_uring;
+
+    // Worker i runs on cpus[i % num_cpus], if any are given. With incoming_cpu
+    // its listeners also ask for the connections whose packets that CPU
+    // handles.
+    int cpus[CPU_SETSIZE];
+    int num_cpus;
+    int incoming_cpu;
+    int rebalance;
+    int stats_interval_s;
+
+    // Read at startup and again on SIGHUP
+    const char *config_file;
+
+    struct listen_addr_t raw_addrs[MAX_LISTEN_ADDRS];
+    int num_raw_addrs;
+    struct listen_addr_t lev_addrs[MAX_LISTEN_ADDRS];
+    int num_lev_addrs;
+
+    // How to build each worker's event_base
+    const char *backend;
+    const char *avoid_backends[8];
+    int num_avoid_backends;
+    int base_flags;
+
+    // How long, and for how many callbacks, the loop runs connection events
+    // before it checks timers and signals again. 0 is no limit.
+    int max_dispatch_us;
+    int max_dispatch_callbacks;
+    // Drive the loop one EVLOOP_ONCE iteration at a time
+    int loop_once;
+};
+
+const struct config_t CONFIG_DEFAULTS = {
+    .num_threads = 1,
+    .read_buf_size = 64 * 1024,
+    .read_budget = 16,
+    .log_level = LOG_HEXDUMP,
+    .log_rate_limit = 10,
+    .backlog = SOMAXCONN,
+    .accept_batch = 64,
+    .echo = 0,
+    .write_high_wm = 256 * 1024,
+    .write_low_wm = 64 * 1024,
+    .idle_timeout_s = 300,
+    .grace_period_s = 5,
+    .admin_port = 0,
+    .framing = FRAMING_NONE,
+    .max_frame_size = 1024 * 1024,
+    .lev_priority = PRIO_CONN,
+    .tls_cache_size = 20 * 1024,
+    .event_log_size = 1024 * 1024,
+    .stats_interval_s = 30,
+};
+
+struct config_t config;
+
+struct worker_t;
+
+// Where a connection's multishot recv is at
+enum uring_recv_t {
+    RECV_IDLE,          // none submitted
+    RECV_ARMED,         // completions keep coming until it's cancelled
+    RECV_CANCELLING,    // cancelled, waiting for the last completion
+};
+
+// Connections on :8888 use the embedded read event (set up with event_assign)
+// so they cost exactly one slot in their worker's pool and nothing else on the
+// heap. Connections on :7777 own a bufferevent instead.
+struct conn_state_t {
+    struct worker_t *worker;
+    evutil_socket_t fd;
+    struct sockaddr_storage peer;
+    struct event event_read_socket;
+    struct bufferevent *bev;
+    struct conn_state_t *next_free;
+
+    // Links in the pool's list of active connections
+    struct conn_state_t *prev;
+    struct conn_state_t *next;
+
+    // What this connection holds against the admission limits
+    int counted;
+    int ip_counted;
+    struct in6_addr ip;
+
+    // Read token bucket for :8888 connections when rate limited. It's topped
+    // up lazily from the worker's rate tick count whenever it's looked at.
+    size_t read_tokens;
+    uint64_t refill_tick;
+    int throttled;
+    struct conn_state_t *throttled_prev;
+    struct conn_state_t *throttled_next;
+
+    // How the connection's bytes come and go
+    const struct transport_t *transport;
+
+    // Buffers for connections on :8888. Reads land in buffers from the
+    // worker's read pool, which big ones stay in: they're attached to input by
+    // reference, so the handler can move them on to output and they go out
+    // from the same memory they were read into. Replies queue up
+    // in output and go out in one writev() once the socket is writable, so
+    // many small replies don't turn into many small writes. There's only an
+    // output in echo mode.
+    struct evbuffer *input;
+    struct evbuffer *output;
+    struct event event_write_socket;
+    int reading_paused;
+
+    // With io_uring the data comes from a multishot recv instead of the read
+    // event, which then only keeps the idle timeout. The generation is part of
+    // the recv's user_data, so completions still in flight for an earlier
+    // connection in the same slot are recognised and dropped.
+    enum uring_recv_t recv;
+    int recv_wanted;
+    uint16_t uring_gen;
+
+    // Bytes left in the input buffer that the handler has already seen, e.g.
+    // an incomplete frame, and how many it wants before it can do anything
+    size_t input_seen;
+    size_t read_low_wm;
+
+    // With --timer-wheel: the tick after which the connection counts as idle,
+    // and its links in the wheel slot it's in, -1 if none
+    uint64_t idle_deadline;
+    int wheel_slot;
+    struct conn_state_t *wheel_prev;
+    struct conn_state_t *wheel_next;
+
+    // When the connection was accepted, and whether its TLS handshake is done
+    uint64_t accepted_ns;
+    int handshake_done;
+
+    // For the event log: totals, and what has been read since the last record
+    uint64_t conn_id;
+    uint64_t bytes_read;
+    uint32_t reads;
+    uint64_t summary_bytes;
+    uint32_t summary_reads;
+    uint64_t summary_ns;
+
+    // For the balancer: bytes read since balance_ns, when the connection was
+    // accepted or last moved to another worker
+    uint64_t balance_bytes;
+    uint64_t balance_ns;
+
+    // Peer address, formatted once at accept time for logging
+    char addr[INET6_ADDRSTRLEN];
+    uint16_t port;
+
+    // Per connection log rate limiting: at most config.log_rate_limit debug
+    // lines per second
+    time_t log_window;
+    int log_count;
+    int log_suppressed;
+};
+
+// Connection states are carved out of slabs and recycled through a free list.
+// Each worker has its own pool so no locking is needed. Slabs are only
+// returned to the system at shutdown. Connections in use are also kept on a
+// list, so shutdown can find them all.
+#define CONN_SLAB_SIZE 256
+
+struct conn_slab_t {
+    struct conn_slab_t *next;
+    struct conn_state_t conns[CONN_SLAB_SIZE];
+};
+
+struct conn_pool_t {
+    struct conn_slab_t *slabs;
+    struct conn_state_t *free_list;
+    struct conn_state_t *active;
+    size_t num_active;
+};
+
+// Read buffers for :8888 are config.read_buf_size bytes each, cache line
+// aligned, and carved out of slabs like the connection states. A buffer that
+// has been read into either goes back to the free list right away, or, when
+// the read filled at least three quarters of it, is attached to the
+// connection's input and comes back once the evbuffer lets go of it. Smaller
+// reads are copied instead, so a trickle of reads doesn't pin a whole buffer
+// each for a fraction of it.
+#define READ_SLAB_SIZE 16
+#define READ_BUF_ALIGN 64
+
+struct read_buf_t {
+    struct read_buf_t *next_free;
+    struct read_pool_t *pool;
+    char *data;
+};
+
+struct read_slab_t {
+    struct read_slab_t *next;
+    char *data;
+    struct read_buf_t bufs[READ_SLAB_SIZE];
+};
+
+struct read_pool_t {
+    struct read_slab_t *slabs;
+    struct read_buf_t *free_list;
+};
+
+// Log lines are formatted into a per-thread buffer and written out in batches,
+// either when the buffer fills up or from a periodic flush timer, so that a busy
+// worker makes one write() for many lines instead of one per printf.
+#define LOG_BUF_SIZE (64 * 1024)
+#define LOG_LINE_MAX 1024
+#define LOG_FLUSH_INTERVAL_MS 100
+
+// How many bytes of each read the hexdump level shows
+#define LOG_HEXDUMP_MAX 64
+
+struct log_buf_t {
+    char data[LOG_BUF_SIZE];
+    size_t len;
+};
+
+// Per worker counters. A worker only ever updates its own, so updates are
+// relaxed loads and stores without any locked instructions. The admin endpoint
+// reads them from the main thread with relaxed loads.
+enum listener_kind_t {
+    LISTENER_RAW,   // :8888
+    LISTENER_LEV,   // :7777
+    NUM_LISTENERS,
+};
+
+const char *LISTENER_NAMES[] = {"8888", "7777"};
+
+enum callback_kind_t {
+    CB_ACCEPT_CONN,
+    CB_READ_SOCKET,
+    CB_WRITE_SOCKET,
+    CB_LEV_ACCEPT,
+    CB_LEV_READ_SOCKET,
+    CB_URING,
+    CB_WORKER_MSGS,
+    NUM_CALLBACKS,
+};
+
+const char *CALLBACK_NAMES[] = {
+    "accept_conn", "read_socket", "write_socket", "lev_accept", "lev_read_socket",
+    "uring", "worker_msgs",
+};
+
+// Bucket i counts values up to 2^i, the last bucket is everything above
+#define STAT_HIST_BUCKETS 24
+
+struct stat_hist_t {
+    uint64_t buckets[STAT_HIST_BUCKETS];
+    uint64_t sum;
+    uint64_t count;
+};
+
+struct listener_stats_t {
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t rejected;
+    uint64_t reads;
+    uint64_t bytes_read;
+    uint64_t migrated_in;
+    uint64_t migrated_out;
+};
+
+struct stats_t {
+    struct listener_stats_t listeners[NUM_LISTENERS];
+    struct stat_hist_t read_size;                   // bytes
+    struct stat_hist_t callback_us[NUM_CALLBACKS];  // microseconds
+    struct stat_hist_t loop_lag_us;                 // microseconds
+    struct stat_hist_t loop_callbacks;              // per iteration, with --loop-once
+
+    // TLS on :7777. Resumed handshakes (session cache or ticket) are counted
+    // in both handshakes and resumed.
+    uint64_t tls_handshakes;
+    uint64_t tls_resumed;
+    uint64_t tls_failed;
+    struct stat_hist_t tls_handshake_us;            // microseconds
+
+    uint64_t event_log_dropped;                     // the writer fell behind
+};
+
+// What a connection does with the bytes it receives. Handlers only deal in
+// evbuffers, so the same logic runs over either transport.
+struct conn_handler_t {
+    // The connection has been accepted and set up
+    void (*on_accept)(struct conn_state_t *state);
+    // num_read new bytes have been added to input. Whatever is handled should
+    // be removed, the rest stays for next time. Replies go to conn_output().
+    // Returns -1 to have the connection closed.
+    int (*on_data)(struct conn_state_t *state, struct evbuffer *input, size_t num_read);
+    // The connection is about to be closed
+    void (*on_close)(struct conn_state_t *state);
+};
+
+// How bytes get in and out: events and recv()/writev() on the socket for the
+// raw listeners, a bufferevent (possibly with TLS) for the others
+struct transport_t {
+    enum listener_kind_t kind;
+    // Where replies go, NULL when not echoing on :8888
+    struct evbuffer *(*output)(struct conn_state_t *state);
+    // Stop reading and close the connection once its output is written
+    void (*drain)(struct conn_state_t *state);
+    // Close the socket and free whatever the transport set up
+    void (*free)(struct conn_state_t *state);
+};
+
+// The timer wheel turns once per worker tick. A revolution covers about 100s,
+// so longer timeouts go round more than once.
+#define WHEEL_SLOTS 1024
+#define WHEEL_TICK_MS LOG_FLUSH_INTERVAL_MS
+
+// The event log. Workers fill in records in a ring of their own, one per
+// worker so there's a single producer and a single consumer, and a writer
+// thread copies them to the memory mapped file every EVSTREAM_FLUSH_MS. When
+// a worker's ring is full records are dropped and counted rather than making
+// the worker wait. Reads are summed up per connection and recorded at most
+// every EVSTREAM_READ_INTERVAL_MS, going by the worker tick.
+#define EVSTREAM_RING_SIZE 8192
+#define EVSTREAM_FLUSH_MS 10
+#define EVSTREAM_READ_INTERVAL_MS 1000
+
+struct event_ring_t {
+    uint64_t head;      // the worker's
+    uint64_t tail __attribute__((aligned(64)));   // the writer's
+    struct evstream_record_t records[EVSTREAM_RING_SIZE];
+};
+
+// Messages for a worker from other threads. Each worker has an intrusive
+// multi-producer single-consumer queue in the style of Vyukov's: a producer
+// swaps its node in as the head with one atomic exchange and then links the
+// previous head to it, and only the worker pops from the tail, so nobody ever
+// takes a lock. A message is normally embedded in a bigger struct, which its
+// handler frees once it has run on the worker.
+struct worker_msg_t {
+    struct worker_msg_t *next;
+    void (*handle)(struct worker_t *w, struct worker_msg_t *msg);
+};
+
+struct msg_queue_t {
+    struct worker_msg_t *head;  // most recently pushed, producers only
+    struct worker_msg_t *tail;  // next to pop, the worker only
+    struct worker_msg_t stub;
+};
+
+#define WORKER_MSG_BUDGET 64
+
+// An io_uring instance per worker for the raw listeners, set up with the raw
+// syscalls. Each listener has a multishot accept and each connection a
+// multishot recv that picks its buffers from a ring of provided buffers. The
+// kernel signals an eventfd whenever it posts completions, and a libevent
+// event on that reaps them, so the ring runs inside the ordinary loop.
+#define URING_SQ_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+#define URING_NUM_BUFS 64
+#define URING_BUF_GROUP 0
+#define URING_CQE_BUDGET 256
+
+// user_data of a connection's recv is its state pointer with the generation
+// in the top bits. Small values are the listeners, 0 is for cancels. Linux
+// only maps user memory above 47 bits for mmap() calls that ask for it, so
+// malloc'd states always fit below the generation.
+#define URING_GEN_SHIFT 48
+#define URING_PTR_MASK ((1ull << URING_GEN_SHIFT) - 1)
+_Static_assert(sizeof(uintptr_t) == sizeof(uint64_t),
+               "io_uring user_data packs a pointer and a generation into 64 bits");
+
+struct uring_t {
+    int fd;
+    int event_fd;
+    struct event *event;
+    int in_callback;    // submissions wait until the completions are reaped
+
+    // Submission queue
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_flags;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;
+    unsigned to_submit;
+
+    // Completion queue, which shares the submission queue's mapping on any
+    // kernel recent enough for the rest of this
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Provided buffers, each config.read_buf_size bytes
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *bufs;
+    unsigned short buf_tail;
+
+    int accept_armed[MAX_LISTEN_ADDRS];
+    int accept_wanted[MAX_LISTEN_ADDRS];
+    int accept_cancelling[MAX_LISTEN_ADDRS];
+
+    // Set when something couldn't get a submission queue entry and was left
+    // for uring_retry
+    int stalled;
+
+    // Cancels of recvs that couldn't get an entry. They're kept here rather
+    // than looked up again, since the connection may be freed before they go.
+    uint64_t pending_cancels[URING_SQ_ENTRIES];
+    unsigned num_pending_cancels;
+};
+
+// Each worker owns an event_base and its own set of listeners. All workers
+// bind the same TCP ports with SO_REUSEPORT so the kernel spreads incoming
+// connections across them. Unix domain sockets can't be shared like that, so
+// only worker 0 listens on those. Worker 0 runs on the main thread.
+struct worker_t {
+    int id;
+    int cpu;    // -1 unless pinned
+    pthread_t thread;
+    struct event_base *base;
+    int num_listeners;
+    evutil_socket_t listeners[MAX_LISTEN_ADDRS];
+    struct event *event_listeners[MAX_LISTEN_ADDRS];
+    int num_lev_listeners;
+    struct evconnlistener *lev_listeners[MAX_LISTEN_ADDRS];
+    struct conn_pool_t conn_pool;
+    struct read_pool_t read_pool;
+
+    struct log_buf_t log;
+
+    // Flushes the log and measures how late the loop is running
+    struct event *event_tick;
+    uint64_t last_tick_ns;
+
+    struct stats_t stats;
+    uint64_t iteration_callbacks;
+
+    // All connections share the same idle timeout, so it is registered as a
+    // common timeout: libevent keeps those in a queue ordered by expiry
+    // instead of one min-heap entry per connection. NULL when disabled, or
+    // when the timer wheel keeps track instead.
+    const struct timeval *idle_timeout;
+    struct timeval idle_tv;
+
+    // The timer wheel, turned by the worker tick. Activity only moves a
+    // connection's deadline; it's put in the right slot when its current
+    // one comes round, so a busy connection costs nothing per read.
+    struct conn_state_t *wheel[WHEEL_SLOTS];
+    uint64_t wheel_tick;
+
+    // Shutdown: event_drain is activated from the main thread once a signal
+    // comes in, then event_grace puts a limit on how long draining takes
+    struct event *event_drain;
+    struct event *event_grace;
+    int draining;
+
+    // Set while both listeners are off because of the connection cap
+    int accept_paused;
+
+    // Rate limiting on :8888. One tick per worker refills the token buckets
+    // and wakes up the connections waiting for tokens, instead of a timer per
+    // connection.
+    struct event *event_rate;
+    uint64_t rate_tick;
+    struct conn_state_t *throttled;
+
+    // This worker's share of the global limit. Reads on :8888 draw from the
+    // same bucket as the :7777 bufferevents in the group, so it covers both.
+    struct bufferevent_rate_limit_group *rate_group;
+
+    // Set when --io-uring is on and the ring could be set up
+    struct uring_t *uring;
+
+    // Messages from other threads. Posting one only activates event_msgs if
+    // msgs_wakeup wasn't already set, so a burst of them costs one wakeup.
+    struct msg_queue_t msgs;
+    struct event *event_msgs;
+    int msgs_wakeup;
+
+    // With --event-log
+    struct event_ring_t *event_ring;
+    uint64_t next_conn_id;
+
+    // With --rebalance: bytes read as of the balancer's last run, and since
+    // the run before. Only the main thread touches these.
+    uint64_t balancer_bytes;
+    uint64_t balancer_load;
+};
+
+struct worker_t *workers;
+
+// With --acceptor-thread one thread accepts everything on the bufferevent
+// listeners and deals the connections out to the workers in turn, instead of
+// each worker accepting its own through SO_REUSEPORT. A listener whose accept
+// fails is left alone for ACCEPT_BACKOFF_MS before it's tried again.
+#define ACCEPT_BACKOFF_MS 100
+
+struct acceptor_t {
+    pthread_t thread;
+    struct event_base *base;
+    int num_listeners;
+    struct evconnlistener *listeners[MAX_LISTEN_ADDRS];
+    struct event *event_resume;
+    int next_worker;
+};
+
+struct acceptor_t *acceptor;
+
+// Picked at startup from --framing
+const struct conn_handler_t *handler;
+
+// Rate limits are refilled every RATE_TICK_MS
+#define RATE_TICK_MS 100
+
+// Shared by every worker when :7777 speaks TLS, NULL otherwise. OpenSSL locks
+// the session cache internally, and session tickets are encrypted with keys
+// kept in the context, so a client can resume on any worker.
+SSL_CTX *ssl_ctx;
+
+// The memory mapped --event-log file, and the thread writing it
+struct event_log_t {
+    int fd;
+    size_t size;
+    struct evstream_header_t *header;
+    struct evstream_record_t *records;
+    uint64_t realtime_offset_ns;   // CLOCK_REALTIME minus now_ns()
+    pthread_t thread;
+    int stop;
+};
+
+struct event_log_t event_log = {.fd = -1};
+
+// The write watermarks and the :8888 rate limit and burst, which only make
+// sense together. A reload points conn_limits at a new copy instead of
+// changing them in place, so a worker never sees half of each. The last worker
+// to handle the reload frees the old one.
+struct conn_limits_t {
+    size_t write_low_wm;
+    size_t write_high_wm;
+    size_t rate_limit;
+    size_t rate_burst;
+};
+
+struct conn_limits_t *conn_limits;
+
+const struct conn_limits_t *get_conn_limits() {
+    return __atomic_load_n(&conn_limits, __ATOMIC_ACQUIRE);
+}
+
+struct conn_limits_t *new_conn_limits() {
+    struct conn_limits_t *limits = malloc(sizeof(struct conn_limits_t));
+    if (limits == NULL) {
+        perror("Failed to malloc conn_limits_t\n");
+        return NULL;
+    }
+    limits->write_low_wm = config.write_low_wm;
+    limits->write_high_wm = config.write_high_wm;
+    limits->rate_limit = config.rate_limit;
+    limits->rate_burst = config.rate_burst;
+    return limits;
+}
+
+// Per connection and per worker token bucket settings for :7777, or NULL.
+// A reload replaces them from the main thread.
+struct ev_token_bucket_cfg *conn_rate_cfg;
+struct ev_token_bucket_cfg *group_rate_cfg;
+
+// The log buffer of the worker running on this thread, if any. Threads without
+// one (e.g. during startup) write straight to stdout.
+__thread struct log_buf_t *thread_log;
+
+#define LOG_ENABLED(level) (config.log_level >= (level))
+
+void log_flush() {
+    struct log_buf_t *log = thread_log;
+    if (log == NULL) {
+        return;
+    }
+
+    size_t off = 0;
+    while (off < log->len) {
+        ssize_t n = write(STDOUT_FILENO, log->data + off, log->len - off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            break; // nowhere to report this, so drop the batch
+        }
+        off += n;
+    }
+    log->len = 0;
+}
+
+// Reserve room for one log line in this thread's buffer, flushing first if
+// it's too full
+char *log_reserve(struct log_buf_t *log) {
+    if (LOG_BUF_SIZE - log->len < LOG_LINE_MAX) {
+        log_flush();
+    }
+    return log->data + log->len;
+}
+
+void log_vmsg(const char *fmt, va_list ap) {
+    struct log_buf_t *log = thread_log;
+    if (log == NULL) {
+        vprintf(fmt, ap);
+        fflush(stdout);
+        return;
+    }
+
+    char *p = log_reserve(log);
+    int n = vsnprintf(p, LOG_LINE_MAX, fmt, ap);
+    if (n >= LOG_LINE_MAX) {
+        n = LOG_LINE_MAX - 1;
+        p[n - 1] = '\n';
+    }
+    if (n > 0) {
+        log->len += n;
+    }
+}
+
+__attribute__((format(printf, 2, 3)))
+void log_msg(enum log_level_t level, const char *fmt, ...) {
+    if (!LOG_ENABLED(level)) {
+        return;
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+    log_vmsg(fmt, ap);
+    va_end(ap);
+}
+
+void log_conn_suppressed(struct conn_state_t *state) {
+    if (state->log_suppressed > 0) {
+        log_msg(LOG_DEBUG, "Suppressed %d log lines for peer %s:%d\n",
+                state->log_suppressed, state->addr, state->port);
+        state->log_suppressed = 0;
+    }
+}
+
+// Returns whether a connection may log another line in the current second.
+// Lines over the limit are counted and reported once the window rolls over.
+int log_conn_allow(struct conn_state_t *state) {
+    struct timeval now;
+    event_base_gettimeofday_cached(state->worker->base, &now);
+
+    if (now.tv_sec != state->log_window) {
+        log_conn_suppressed(state);
+        state->log_window = now.tv_sec;
+        state->log_count = 0;
+    }
+
+    if (config.log_rate_limit > 0 && state->log_count >= config.log_rate_limit) {
+        state->log_suppressed++;
+        return 0;
+    }
+    state->log_count++;
+    return 1;
+}
+
+// Log a read (or frame) of num_read bytes whose first bytes are in vec. At the
+// hexdump level the bytes are hex encoded by hand straight into the log buffer.
+void log_data(struct conn_state_t *state, const char *what, size_t num_read,
+              const struct evbuffer_iovec *vec, int n_vec) {
+    if (!LOG_ENABLED(LOG_DEBUG) || !log_conn_allow(state)) {
+        return;
+    }
+
+    if (!LOG_ENABLED(LOG_HEXDUMP) || thread_log == NULL) {
+        log_msg(LOG_DEBUG, "%s %zu bytes from peer: %s:%d\n",
+                what, num_read, state->addr, state->port);
+        return;
+    }
+
+    static const char hex[] = "0123456789abcdef";
+    struct log_buf_t *log = thread_log;
+    char *p = log_reserve(log);
+    char *start = p;
+
+    p += snprintf(p, LOG_LINE_MAX - 3 * LOG_HEXDUMP_MAX - 8,
+                  "%s %zu bytes from peer: %s:%d:", what, num_read, state->addr, state->port);
+
+    size_t limit = num_read < LOG_HEXDUMP_MAX ? num_read : LOG_HEXDUMP_MAX;
+    size_t dumped = 0;
+    for (int i = 0; i < n_vec && dumped < limit; ++i) {
+        const unsigned char *buf = vec[i].iov_base;
+        for (size_t j = 0; j < vec[i].iov_len && dumped < limit; ++j) {
+            *p++ = ' ';
+            *p++ = hex[buf[j] >> 4];
+            *p++ = hex[buf[j] & 0xf];
+            dumped++;
+        }
+    }
+    if (dumped < num_read) {
+        p += sprintf(p, " ...");
+    }
+    *p++ = '\n';
+
+    log->len += p - start;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stat_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+uint64_t stat_load(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void stat_hist_record(struct stat_hist_t *h, uint64_t value) {
+    int i = value <= 1 ? 0 : 64 - __builtin_clzll(value - 1);
+    if (i >= STAT_HIST_BUCKETS) {
+        i = STAT_HIST_BUCKETS - 1;
+    }
+    stat_add(&h->buckets[i], 1);
+    stat_add(&h->sum, value);
+    stat_add(&h->count, 1);
+}
+
+// Each cb_ callback below is a thin wrapper that counts, and with CB_TIMING
+// times, the function doing the actual work. Timing costs two clock reads per
+// callback, so it's only built in on request (make profile). Only callbacks
+// for one connection count towards the iteration's total, so an accept run
+// from inside the worker messages isn't counted twice.
+uint64_t callback_start_ns() {
+#ifdef CB_TIMING
+    return now_ns();
+#else
+    return 0;
+#endif
+}
+
+void stats_record_callback(struct worker_t *w, enum callback_kind_t cb, uint64_t start_ns) {
+    if (cb == CB_READ_SOCKET || cb == CB_WRITE_SOCKET || cb == CB_LEV_READ_SOCKET) {
+        w->iteration_callbacks++;
+    }
+#ifdef CB_TIMING
+    uint64_t took_ns = now_ns() - start_ns;
+    stat_hist_record(&w->stats.callback_us[cb], took_ns / 1000);
+    TRACE3(callback, w->id, cb, took_ns);
+#endif
+}
+
+void stats_record_read(struct worker_t *w, enum listener_kind_t kind, size_t num_read) {
+    stat_add(&w->stats.listeners[kind].reads, 1);
+    stat_add(&w->stats.listeners[kind].bytes_read, num_read);
+    stat_hist_record(&w->stats.read_size, num_read);
+}
+
+// Reserve the next record in the worker's ring, or NULL if it's full. It's
+// handed to the writer by event_log_commit().
+struct evstream_record_t *event_log_reserve(struct worker_t *w) {
+    struct event_ring_t *ring = w->event_ring;
+    if (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= EVSTREAM_RING_SIZE) {
+        stat_add(&w->stats.event_log_dropped, 1);
+        return NULL;
+    }
+    return &ring->records[ring->head % EVSTREAM_RING_SIZE];
+}
+
+void event_log_commit(struct worker_t *w) {
+    __atomic_store_n(&w->event_ring->head, w->event_ring->head + 1, __ATOMIC_RELEASE);
+}
+
+// Start a record about a connection, with everything but the numbers
+struct evstream_record_t *event_log_conn(struct conn_state_t *state, enum evstream_kind_t kind,
+                                         uint64_t now) {
+    struct evstream_record_t *rec = event_log_reserve(state->worker);
+    if (rec == NULL) {
+        return NULL;
+    }
+    memset(rec, 0, sizeof(*rec));
+    rec->time_ns = now + event_log.realtime_offset_ns;
+    rec->conn_id = state->conn_id;
+    rec->kind = kind;
+    rec->listener = state->transport->kind;
+    rec->family = state->peer.ss_family;
+    rec->worker = state->worker->id;
+    rec->port = state->port;
+    if (state->peer.ss_family == AF_INET) {
+        memcpy(rec->addr, &((struct sockaddr_in*) &state->peer)->sin_addr, 4);
+    } else if (state->peer.ss_family == AF_INET6) {
+        memcpy(rec->addr, &((struct sockaddr_in6*) &state->peer)->sin6_addr, 16);
+    }
+    return rec;
+}
+
+void event_log_accept(struct conn_state_t *state) {
+    struct worker_t *w = state->worker;
+
+    state->conn_id = (uint64_t) w->id << 56 | ++w->next_conn_id;
+    state->summary_ns = now_ns();
+    struct evstream_record_t *rec = event_log_conn(state, EVSTREAM_ACCEPT, state->summary_ns);
+    if (rec) {
+        event_log_commit(w);
+    }
+}
+
+void event_log_read(struct conn_state_t *state, size_t num_read) {
+    uint64_t now = state->worker->last_tick_ns;
+
+    state->bytes_read += num_read;
+    state->reads++;
+    state->summary_bytes += num_read;
+    state->summary_reads++;
+    if (now < state->summary_ns + EVSTREAM_READ_INTERVAL_MS * 1000000ull) {
+        return;
+    }
+
+    struct evstream_record_t *rec = event_log_conn(state, EVSTREAM_READ, now);
+    if (rec) {
+        rec->bytes = state->summary_bytes;
+        rec->reads = state->summary_reads;
+        rec->duration_us = (now - state->summary_ns) / 1000;
+        event_log_commit(state->worker);
+    }
+    state->summary_bytes = 0;
+    state->summary_reads = 0;
+    state->summary_ns = now;
+}
+
+void event_log_close(struct conn_state_t *state, const char *why) {
+    uint64_t now = now_ns();
+    struct evstream_record_t *rec = event_log_conn(state, EVSTREAM_CLOSE, now);
+    if (rec == NULL) {
+        return;
+    }
+    rec->bytes = state->bytes_read;
+    rec->reads = state->reads;
+    rec->duration_us = (now - state->accepted_ns) / 1000;
+    if (why == NULL) {
+        rec->reason = EVSTREAM_CLOSED;
+    } else if (strcmp(why, "timed out") == 0) {
+        rec->reason = EVSTREAM_TIMED_OUT;
+    } else {
+        rec->reason = EVSTREAM_DISCONNECTED;
+    }
+    event_log_commit(state->worker);
+}
+
+// Copy whatever the workers have recorded into the file. Only the writer
+// thread calls this, and at exit the main thread once the writer is done.
+void event_log_flush() {
+    struct evstream_header_t *header = event_log.header;
+    uint64_t count = header->count;
+
+    for (int i = 0; i < config.num_threads; ++i) {
+        struct event_ring_t *ring = workers[i].event_ring;
+        uint64_t tail = ring->tail;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (; tail != head; ++tail) {
+            event_log.records[count++ % header->capacity] =
+                ring->records[tail % EVSTREAM_RING_SIZE];
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&header->count, count, __ATOMIC_RELEASE);
+}
+
+void *run_event_log(void *arg) {
+    struct timespec interval = {0, EVSTREAM_FLUSH_MS * 1000000};
+    while (!__atomic_load_n(&event_log.stop, __ATOMIC_ACQUIRE)) {
+        event_log_flush();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+// Create the file, all of it up front, so the writer never has to grow it
+int event_log_open() {
+    event_log.size = EVSTREAM_HEADER_SIZE + config.event_log_size * sizeof(struct evstream_record_t);
+    event_log.fd = open(config.event_log, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (event_log.fd < 0) {
+        perror("Failed to open event log\n");
+        return -1;
+    }
+    if (ftruncate(event_log.fd, event_log.size) < 0) {
+        perror("Failed to size event log\n");
+        return -1;
+    }
+    char *map = mmap(NULL, event_log.size, PROT_READ | PROT_WRITE, MAP_SHARED, event_log.fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to mmap event log\n");
+        return -1;
+    }
+    event_log.header = (struct evstream_header_t*) map;
+    event_log.records = (struct evstream_record_t*) (map + EVSTREAM_HEADER_SIZE);
+    event_log.header->magic = EVSTREAM_MAGIC;
+    event_log.header->version = EVSTREAM_VERSION;
+    event_log.header->record_size = sizeof(struct evstream_record_t);
+    event_log.header->capacity = config.event_log_size;
+    event_log.header->count = 0;
+
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    event_log.realtime_offset_ns = real.tv_sec * 1000000000ull + real.tv_nsec - now_ns();
+    return 0;
+}
+
+// Stop the writer, write out the rest and unmap the file. The workers must
+// have been freed, so the connections they closed are in their rings.
+void event_log_finish() {
+    __atomic_store_n(&event_log.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(event_log.thread, NULL);
+    event_log_flush();
+
+    uint64_t dropped = 0;
+    for (int i = 0; i < config.num_threads; ++i) {
+        dropped += workers[i].stats.event_log_dropped;
+    }
+    log_msg(LOG_INFO, "Wrote %lu records to %s, dropped %lu\n",
+            event_log.header->count, config.event_log, dropped);
+    munmap(event_log.header, event_log.size);
+    close(event_log.fd);
+}
+
+// Admission control. The connection cap counts the connections of all workers
+// on both ports in one atomic counter. Per address counts live in an open
+// addressed table that all workers share, since SO_REUSEPORT spreads a
+// client's connections across workers. It's split into shards by hash, each
+// with its own lock, so workers accepting at the same time rarely wait on
+// each other. A shard uses linear probing with backward shift deletion, so it
+// never needs tombstones, and doubles in size once it's 3/4 full.
+// Addresses are stored as IPv6, with IPv4 ones mapped to ::ffff:a.b.c.d, so a
+// client counts the same whether it came in over an IPv4 or a dual stack
+// listener.
+#define IP_TABLE_SHARDS 64
+#define IP_SHARD_MIN_SLOTS 64
+
+// What ip_table_acquire returns when a shard couldn't grow
+#define IP_TABLE_FULL -2
+
+struct ip_slot_t {
+    struct in6_addr addr;
+    uint32_t count;     // 0 means the slot is empty
+};
+
+// Each shard on its own cache line, so taking one lock doesn't slow down
+// another worker using the next shard
+struct ip_shard_t {
+    pthread_mutex_t lock;
+    struct ip_slot_t *slots;
+    size_t mask;
+    size_t used;
+} __attribute__((aligned(64)));
+
+size_t num_conns;
+struct ip_shard_t ip_table[IP_TABLE_SHARDS];
+
+int ip_table_init() {
+    for (int i = 0; i < IP_TABLE_SHARDS; ++i) {
+        pthread_mutex_init(&ip_table[i].lock, NULL);
+        ip_table[i].slots = calloc(IP_SHARD_MIN_SLOTS, sizeof(struct ip_slot_t));
+        if (ip_table[i].slots == NULL) {
+            perror("Failed to malloc address table\n");
+            return -1;
+        }
+        ip_table[i].mask = IP_SHARD_MIN_SLOTS - 1;
+    }
+    return 0;
+}
+
+void ip_table_free() {
+    for (int i = 0; i < IP_TABLE_SHARDS; ++i) {
+        free(ip_table[i].slots);
+        pthread_mutex_destroy(&ip_table[i].lock);
+    }
+}
+
+uint64_t ip_table_hash(const struct in6_addr *addr) {
+    uint64_t half[2];
+    memcpy(half, addr, sizeof(half));
+    return (half[0] ^ (half[1] * 0x9E3779B97F4A7C15ull)) * 0x9E3779B97F4A7C15ull;
+}
+
+// The low bits pick the shard, the high ones the slot in it
+struct ip_shard_t *ip_table_shard(const struct in6_addr *addr) {
+    return &ip_table[ip_table_hash(addr) % IP_TABLE_SHARDS];
+}
+
+size_t ip_shard_home(const struct ip_shard_t *shard, const struct in6_addr *addr) {
+    return (size_t) (ip_table_hash(addr) >> 32) & shard->mask;
+}
+
+int ip_table_match(const struct ip_slot_t *slot, const struct in6_addr *addr) {
+    return memcmp(&slot->addr, addr, sizeof(*addr)) == 0;
+}
+
+// Double a shard's slots and put every entry back. Called with its lock held.
+int ip_shard_grow(struct ip_shard_t *shard) {
+    size_t size = (shard->mask + 1) * 2;
+    struct ip_slot_t *slots = calloc(size, sizeof(struct ip_slot_t));
+    if (slots == NULL) {
+        perror("Failed to grow address table\n");
+        return -1;
+    }
+    struct ip_slot_t *old = shard->slots;
+    size_t old_size = shard->mask + 1;
+    shard->slots = slots;
+    shard->mask = size - 1;
+    for (size_t i = 0; i < old_size; ++i) {
+        if (old[i].count == 0) {
+            continue;
+        }
+        size_t j = ip_shard_home(shard, &old[i].addr);
+        while (slots[j].count > 0) {
+            j = (j + 1) & shard->mask;
+        }
+        slots[j] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+// Count another connection from addr. Returns -1 if that would go over the
+// limit, or IP_TABLE_FULL if there's no room for a new address.
+int ip_table_acquire(const struct in6_addr *addr) {
+    struct ip_shard_t *shard = ip_table_shard(addr);
+    int ret = -1;
+    pthread_mutex_lock(&shard->lock);
+
+    size_t i = ip_shard_home(shard, addr);
+    while (shard->slots[i].count > 0 && !ip_table_match(&shard->slots[i], addr)) {
+        i = (i + 1) & shard->mask;
+    }
+    if (shard->slots[i].count == 0) {
+        if (shard->used + 1 > (shard->mask + 1) * 3 / 4) {
+            if (ip_shard_grow(shard) < 0) {
+                pthread_mutex_unlock(&shard->lock);
+                return IP_TABLE_FULL;
+            }
+            i = ip_shard_home(shard, addr);
+            while (shard->slots[i].count > 0) {
+                i = (i + 1) & shard->mask;
+            }
+        }
+        shard->slots[i].addr = *addr;
+        shard->slots[i].count = 1;
+        shard->used++;
+        ret = 0;
+    } else if (shard->slots[i].count < (uint32_t) config.max_conns_per_ip) {
+        shard->slots[i].count++;
+        ret = 0;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    return ret;
+}
+
+void ip_table_release(const struct in6_addr *addr) {
+    struct ip_shard_t *shard = ip_table_shard(addr);
+    pthread_mutex_lock(&shard->lock);
+
+    struct ip_slot_t *slots = shard->slots;
+    size_t i = ip_shard_home(shard, addr);
+    while (slots[i].count == 0 || !ip_table_match(&slots[i], addr)) {
+        i = (i + 1) & shard->mask;
+    }
+
+    if (--slots[i].count == 0) {
+        // Move later entries of the same probe run back into the hole, unless
+        // that would put them in front of their home slot
+        size_t j = i;
+        for (;;) {
+            j = (j + 1) & shard->mask;
+            if (slots[j].count == 0) {
+                break;
+            }
+            size_t home = ip_shard_home(shard, &slots[j].addr);
+            if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+                continue;
+            }
+            slots[i] = slots[j];
+            i = j;
+        }
+        slots[i].count = 0;
+        shard->used--;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// The io_uring plumbing. There's no liburing here, the rings are mapped and
+// driven by hand.
+int uring_setup_rings(struct uring_t *u) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+
+    u->fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &params);
+    if (u->fd < 0) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    u->sq_ring_size = sq_size > cq_size ? sq_size : cq_size;
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        return -1;
+    }
+    u->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        return -1;
+    }
+
+    char *ring = u->sq_ring;
+    u->sq_entries = params.sq_entries;
+    u->sq_head = (unsigned*) (ring + params.sq_off.head);
+    u->sq_tail = (unsigned*) (ring + params.sq_off.tail);
+    u->sq_mask = (unsigned*) (ring + params.sq_off.ring_mask);
+    u->sq_flags = (unsigned*) (ring + params.sq_off.flags);
+    u->sq_array = (unsigned*) (ring + params.sq_off.array);
+    u->sqe_tail = *u->sq_tail;
+    u->cq_head = (unsigned*) (ring + params.cq_off.head);
+    u->cq_tail = (unsigned*) (ring + params.cq_off.tail);
+    u->cq_mask = (unsigned*) (ring + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*) (ring + params.cq_off.cqes);
+    return 0;
+}
+
+// Multishot recv came after multishot accept and buffer rings, in the same
+// release as zero copy send, which is something the probe can see
+int uring_supported(struct uring_t *u) {
+    size_t len = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (probe == NULL) {
+        return 0;
+    }
+    int ok = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, probe,
+                     IORING_OP_LAST) == 0 &&
+        probe->last_op >= IORING_OP_SEND_ZC &&
+        (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+char *uring_buf(struct uring_t *u, unsigned short bid) {
+    return u->bufs + (size_t) bid * config.read_buf_size;
+}
+
+// Hand a buffer back to the kernel
+void uring_recycle(struct uring_t *u, unsigned short bid) {
+    struct io_uring_buf *buf = &u->buf_ring->bufs[u->buf_tail & (URING_NUM_BUFS - 1)];
+    buf->addr = (uint64_t) (uintptr_t) uring_buf(u, bid);
+    buf->len = config.read_buf_size;
+    buf->bid = bid;
+    u->buf_tail++;
+    __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+int uring_setup_bufs(struct uring_t *u) {
+    u->buf_ring_size = URING_NUM_BUFS * sizeof(struct io_uring_buf);
+    u->buf_ring = mmap(NULL, u->buf_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->buf_ring == MAP_FAILED) {
+        u->buf_ring = NULL;
+        return -1;
+    }
+    if (posix_memalign((void**) &u->bufs, 4096, URING_NUM_BUFS * config.read_buf_size)) {
+        u->bufs = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) u->buf_ring;
+    reg.ring_entries = URING_NUM_BUFS;
+    reg.bgid = URING_BUF_GROUP;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+    for (unsigned short bid = 0; bid < URING_NUM_BUFS; ++bid) {
+        uring_recycle(u, bid);
+    }
+    return 0;
+}
+
+void uring_free(struct uring_t *u) {
+    if (u->event) {
+        event_free(u->event);
+    }
+    if (u->event_fd >= 0) {
+        close(u->event_fd);
+    }
+    // Closing the ring cancels whatever is still outstanding
+    if (u->fd >= 0) {
+        close(u->fd);
+    }
+    if (u->sqes) {
+        munmap(u->sqes, u->sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if (u->sq_ring) {
+        munmap(u->sq_ring, u->sq_ring_size);
+    }
+    if (u->buf_ring) {
+        munmap(u->buf_ring, u->buf_ring_size);
+    }
+    free(u->bufs);
+    free(u);
+}
+
+void uring_submit(struct uring_t *u) {
+    if (u->to_submit == 0) {
+        return;
+    }
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+    int ret = syscall(__NR_io_uring_enter, u->fd, u->to_submit, 0, 0, NULL, 0);
+    if (ret < 0) {
+        // EBUSY means completions have overflowed; the next reap retries
+        if (errno != EINTR && errno != EBUSY) {
+            perror("Failed to submit to io_uring\n");
+        }
+        return;
+    }
+    u->to_submit -= ret;
+}
+
+// Outside of the completion callback submit right away, inside it everything
+// queued goes in one io_uring_enter() at the end
+void uring_kick(struct uring_t *u) {
+    if (!u->in_callback) {
+        uring_submit(u);
+    }
+}
+
+// Returns NULL if the queue is full and what's in it can't be submitted
+// either, e.g. with EBUSY while completions back up. The caller leaves its
+// state as if it hadn't tried, and uring_retry picks it up again once the
+// completions have been reaped. Cancels are the exception: they're queued up
+// by uring_cancel_later, since what they're for may be gone by then.
+struct io_uring_sqe *uring_sqe(struct uring_t *u) {
+    if (u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        uring_submit(u);
+        if (u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+            u->stalled = 1;
+            return NULL;
+        }
+    }
+    unsigned idx = u->sqe_tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    u->sqe_tail++;
+    u->to_submit++;
+    return sqe;
+}
+
+int uring_cancel(struct uring_t *u, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = 0;
+    uring_kick(u);
+    return 0;
+}
+
+// Like uring_cancel, but keeps the cancel for uring_retry if the queue is
+// full. Returns -1 only once there's no room left for that either.
+int uring_cancel_later(struct uring_t *u, uint64_t user_data) {
+    if (uring_cancel(u, user_data) == 0) {
+        return 0;
+    }
+    if (u->num_pending_cancels == URING_SQ_ENTRIES) {
+        return -1;
+    }
+    u->pending_cancels[u->num_pending_cancels++] = user_data;
+    return 0;
+}
+
+void uring_start_accept(struct worker_t *w, int i) {
+    struct uring_t *u = w->uring;
+
+    u->accept_wanted[i] = 1;
+    if (u->accept_armed[i]) {
+        return;
+    }
+    // accept4 hands back a socket that is already nonblocking, and so does this
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = w->listeners[i];
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = i + 1;
+    u->accept_armed[i] = 1;
+    uring_kick(u);
+}
+
+void uring_stop_accept(struct worker_t *w, int i) {
+    struct uring_t *u = w->uring;
+
+    u->accept_wanted[i] = 0;
+    if (u->accept_armed[i] && !u->accept_cancelling[i] && uring_cancel(u, i + 1) == 0) {
+        u->accept_cancelling[i] = 1;
+    }
+}
+
+uint64_t uring_conn_data(struct conn_state_t *state) {
+    return (uint64_t) (uintptr_t) state | (uint64_t) state->uring_gen << URING_GEN_SHIFT;
+}
+
+void uring_start_recv(struct conn_state_t *state) {
+    struct uring_t *u = state->worker->uring;
+
+    state->recv_wanted = 1;
+    if (state->recv != RECV_IDLE) {
+        return; // a cancelled one is re-armed once its last completion is in
+    }
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = state->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = uring_conn_data(state);
+    state->recv = RECV_ARMED;
+    uring_kick(u);
+}
+
+void uring_stop_recv(struct conn_state_t *state) {
+    state->recv_wanted = 0;
+    if (state->recv == RECV_ARMED &&
+        uring_cancel_later(state->worker->uring, uring_conn_data(state)) == 0) {
+        state->recv = RECV_CANCELLING;
+    }
+}
+
+// Accepts that failed are retried from the worker tick rather than straight
+// away, so running out of file descriptors doesn't turn into a busy loop.
+// Whatever couldn't get into the queue is caught up with here too, from the
+// tick or as soon as the completions that held it up have been reaped.
+void uring_retry(struct worker_t *w) {
+    struct uring_t *u = w->uring;
+    int stalled = u->stalled;
+
+    u->stalled = 0;
+    while (u->num_pending_cancels > 0 &&
+           uring_cancel(u, u->pending_cancels[u->num_pending_cancels - 1]) == 0) {
+        u->num_pending_cancels--;
+    }
+    for (int i = 0; i < w->num_listeners; ++i) {
+        if (u->accept_wanted[i] && !u->accept_armed[i]) {
+            uring_start_accept(w, i);
+        } else if (!u->accept_wanted[i] && u->accept_armed[i]) {
+            uring_stop_accept(w, i);
+        }
+    }
+    if (!stalled) {
+        return;
+    }
+    // :7777 connections never want a recv, so they're left alone by this
+    for (struct conn_state_t *state = w->conn_pool.active; state; state = state->next) {
+        if (state->recv_wanted && state->recv == RECV_IDLE) {
+            uring_start_recv(state);
+        } else if (!state->recv_wanted && state->recv == RECV_ARMED) {
+            uring_stop_recv(state);
+        }
+    }
+}
+
+// Start and stop reading from a :8888 connection, whichever way it's read
+int raw_start_reading(struct conn_state_t *state) {
+    struct worker_t *w = state->worker;
+
+    if (w->uring) {
+        uring_start_recv(state);
+        return w->idle_timeout ? event_add(&state->event_read_socket, w->idle_timeout) : 0;
+    }
+    return event_add(&state->event_read_socket, w->idle_timeout);
+}
+
+void raw_stop_reading(struct conn_state_t *state) {
+    event_del(&state->event_read_socket);
+    if (state->worker->uring) {
+        uring_stop_recv(state);
+    }
+}
+
+// Turn all of a worker's listeners on or off
+void set_accepting(struct worker_t *w, int on) {
+    for (int i = 0; i < w->num_listeners; ++i) {
+        if (w->uring) {
+            if (on) {
+                uring_start_accept(w, i);
+            } else {
+                uring_stop_accept(w, i);
+            }
+        } else if (on) {
+            event_add(w->event_listeners[i], NULL);
+        } else {
+            event_del(w->event_listeners[i]);
+        }
+    }
+    for (int i = 0; i < w->num_lev_listeners; ++i) {
+        if (on) {
+            evconnlistener_enable(w->lev_listeners[i]);
+        } else {
+            evconnlistener_disable(w->lev_listeners[i]);
+        }
+    }
+}
+
+void pause_accepting(struct worker_t *w) {
+    if (w->accept_paused || w->draining) {
+        return;
+    }
+    log_msg(LOG_INFO, "Worker %d reached the limit of %zu connections, not accepting\n",
+            w->id, config.max_conns);
+    set_accepting(w, 0);
+    w->accept_paused = 1;
+}
+
+// Called after connections have closed, here or on another worker
+void maybe_resume_accepting(struct worker_t *w) {
+    if (!w->accept_paused || w->draining ||
+        __atomic_load_n(&num_conns, __ATOMIC_RELAXED) >= config.max_conns) {
+        return;
+    }
+    log_msg(LOG_INFO, "Worker %d accepting connections again\n", w->id);
+    set_accepting(w, 1);
+    w->accept_paused = 0;
+}
+
+// Take a slot under the connection cap, or stop accepting if there is none
+int admit_conn(struct conn_state_t *state) {
+    if (config.max_conns == 0) {
+        return 0;
+    }
+    if (__atomic_add_fetch(&num_conns, 1, __ATOMIC_RELAXED) > config.max_conns) {
+        __atomic_sub_fetch(&num_conns, 1, __ATOMIC_RELAXED);
+        pause_accepting(state->worker);
+        return -1;
+    }
+    state->counted = 1;
+    return 0;
+}
+
+// Apply the per address limit once the peer is known. Returns -1 over the
+// limit, IP_TABLE_FULL if the address couldn't be counted at all.
+int admit_peer(struct conn_state_t *state, const struct sockaddr *sa) {
+    struct in6_addr addr;
+
+    if (config.max_conns_per_ip == 0) {
+        return 0;
+    }
+    if (sa->sa_family == AF_INET) {
+        memset(&addr, 0, sizeof(addr));
+        addr.s6_addr[10] = addr.s6_addr[11] = 0xff;
+        memcpy(&addr.s6_addr[12], &((const struct sockaddr_in*) sa)->sin_addr, 4);
+    } else if (sa->sa_family == AF_INET6) {
+        addr = ((const struct sockaddr_in6*) sa)->sin6_addr;
+    } else {
+        return 0;   // local peers on a Unix domain socket aren't limited
+    }
+
+    int ret = ip_table_acquire(&addr);
+    if (ret < 0) {
+        return ret;
+    }
+    state->ip = addr;
+    state->ip_counted = 1;
+    return 0;
+}
+
+void release_admission(struct conn_state_t *state) {
+    if (state->ip_counted) {
+        ip_table_release(&state->ip);
+    }
+    if (state->counted) {
+        __atomic_sub_fetch(&num_conns, 1, __ATOMIC_RELAXED);
+        maybe_resume_accepting(state->worker);
+    }
+}
+
+void msg_queue_init(struct msg_queue_t *q) {
+    q->stub.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+}
+
+void msg_queue_push(struct msg_queue_t *q, struct worker_msg_t *msg) {
+    __atomic_store_n(&msg->next, NULL, __ATOMIC_RELAXED);
+    struct worker_msg_t *prev = __atomic_exchange_n(&q->head, msg, __ATOMIC_ACQ_REL);
+    // Until this store the message can't be reached from the tail yet
+    __atomic_store_n(&prev->next, msg, __ATOMIC_RELEASE);
+}
+
+// Returns NULL when the queue is empty, but also when a producer is between
+// its two steps. That producer wakes the worker again afterwards.
+struct worker_msg_t *msg_queue_pop(struct msg_queue_t *q) {
+    struct worker_msg_t *tail = q->tail;
+    struct worker_msg_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &q->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    // tail is the last one, put the stub behind it so it can be handed out
+    msg_queue_push(q, &q->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+// Hand a message to a worker, from any thread
+void worker_post(struct worker_t *w, struct worker_msg_t *msg) {
+    msg_queue_push(&w->msgs, msg);
+    if (!__atomic_exchange_n(&w->msgs_wakeup, 1, __ATOMIC_ACQ_REL)) {
+        event_active(w->event_msgs, EV_READ, 0);
+    }
+}
+
+// Run the messages that have come in, up to a budget. The flag is cleared
+// before looking at the queue, so anything pushed from then on wakes the
+// worker again.
+void worker_msgs(evutil_socket_t fd, short what, void *arg) {
+    struct worker_t *w = arg;
+
+    __atomic_exchange_n(&w->msgs_wakeup, 0, __ATOMIC_ACQ_REL);
+    for (int i = 0; i < WORKER_MSG_BUDGET; ++i) {
+        struct worker_msg_t *msg = msg_queue_pop(&w->msgs);
+        if (msg == NULL) {
+            return;
+        }
+        msg->handle(w, msg);
+    }
+    event_active(w->event_msgs, EV_READ, 0);
+}
+
+void cb_worker_msgs(evutil_socket_t fd, short what, void *arg) {
+    struct worker_t *w = arg;
+    uint64_t start_ns = callback_start_ns();
+    worker_msgs(fd, what, arg);
+    stats_record_callback(w, CB_WORKER_MSGS, start_ns);
+}
+
+int conn_pool_grow(struct conn_pool_t *pool) {
+    struct conn_slab_t *slab = malloc(sizeof(struct conn_slab_t));
+    if (slab == NULL) {
+        perror("Failed to malloc conn_slab_t\n");
+        return -1;
+    }
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    for (int i = 0; i < CONN_SLAB_SIZE; ++i) {
+        slab->conns[i].next_free = pool->free_list;
+        pool->free_list = &slab->conns[i];
+    }
+    return 0;
+}
+
+struct conn_state_t *alloc_conn_state(struct worker_t *w) {
+    struct conn_pool_t *pool = &w->conn_pool;
+    if (pool->free_list == NULL && conn_pool_grow(pool) < 0) {
+        return NULL;
+    }
+
+    struct conn_state_t *state = pool->free_list;
+    pool->free_list = state->next_free;
+    pool->num_active++;
+
+    // Keep the io_uring generation, it has to outlive the connection
+    uint16_t uring_gen = state->uring_gen;
+    memset(state, 0, sizeof(*state));
+    state->uring_gen = uring_gen;
+    state->worker = w;
+    state->fd = -1;
+
+    state->next = pool->active;
+    if (pool->active) {
+        pool->active->prev = state;
+    }
+    pool->active = state;
+    return state;
+}
+
+// Give a slot back to its pool
+void put_conn_state(struct conn_state_t *state) {
+    struct conn_pool_t *pool = &state->worker->conn_pool;
+
+    if (state->prev) {
+        state->prev->next = state->next;
+    } else {
+        pool->active = state->next;
+    }
+    if (state->next) {
+        state->next->prev = state->prev;
+    }
+
+    state->next_free = pool->free_list;
+    pool->free_list = state;
+    pool->num_active--;
+}
+
+// Also gives back whatever the connection held against the admission limits,
+// so every path that drops a connection does that exactly once
+void free_conn_state(struct conn_state_t *state) {
+    release_admission(state);
+    put_conn_state(state);
+}
+
+// Give all slabs back. Every connection must have been closed by now.
+void conn_pool_destroy(struct conn_pool_t *pool) {
+    while (pool->slabs) {
+        struct conn_slab_t *slab = pool->slabs;
+        pool->slabs = slab->next;
+        free(slab);
+    }
+    pool->free_list = NULL;
+}
+
+int read_pool_grow(struct read_pool_t *pool) {
+    struct read_slab_t *slab = malloc(sizeof(struct read_slab_t));
+    if (slab == NULL) {
+        perror("Failed to malloc read_slab_t\n");
+        return -1;
+    }
+    if (posix_memalign((void**) &slab->data, READ_BUF_ALIGN,
+                       READ_SLAB_SIZE * config.read_buf_size)) {
+        perror("Failed to allocate read buffers\n");
+        free(slab);
+        return -1;
+    }
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    for (int i = 0; i < READ_SLAB_SIZE; ++i) {
+        struct read_buf_t *buf = &slab->bufs[i];
+        buf->pool = pool;
+        buf->data = slab->data + i * config.read_buf_size;
+        buf->next_free = pool->free_list;
+        pool->free_list = buf;
+    }
+    return 0;
+}
+
+struct read_buf_t *read_buf_get(struct read_pool_t *pool) {
+    if (pool->free_list == NULL && read_pool_grow(pool) < 0) {
+        return NULL;
+    }
+    struct read_buf_t *buf = pool->free_list;
+    pool->free_list = buf->next_free;
+    return buf;
+}
+
+void read_buf_put(struct read_buf_t *buf) {
+    buf->next_free = buf->pool->free_list;
+    buf->pool->free_list = buf;
+}
+
+// Called by libevent once the last of a referenced buffer has been written
+// out or drained
+void read_buf_release(const void *data, size_t len, void *arg) {
+    read_buf_put(arg);
+}
+
+// Add what was read into buf to an evbuffer, by reference or by copying. The
+// buffer isn't the caller's any more either way.
+int read_buf_add(struct evbuffer *input, struct read_buf_t *buf, size_t len) {
+    if (len < config.read_buf_size - config.read_buf_size / 4) {
+        int ret = evbuffer_add(input, buf->data, len);
+        read_buf_put(buf);
+        return ret;
+    }
+    if (evbuffer_add_reference(input, buf->data, len, read_buf_release, buf) < 0) {
+        read_buf_put(buf);
+        return -1;
+    }
+    return 0;
+}
+
+// Give all slabs back. Every connection must have been closed by now, so no
+// evbuffer still refers to them.
+void read_pool_destroy(struct read_pool_t *pool) {
+    while (pool->slabs) {
+        struct read_slab_t *slab = pool->slabs;
+        pool->slabs = slab->next;
+        free(slab->data);
+        free(slab);
+    }
+    pool->free_list = NULL;
+}
+
+size_t rate_per_tick(size_t rate) {
+    size_t n = rate * RATE_TICK_MS / 1000;
+    return n > 0 ? n : 1;
+}
+
+// Each worker gets an equal share of the global limit
+size_t worker_rate_share() {
+    return config.global_rate_limit / config.num_threads;
+}
+
+// Token bucket settings for the bufferevents, from config. libevent counts
+// rates per tick rather than per second.
+struct ev_token_bucket_cfg *new_conn_rate_cfg() {
+    struct timeval rate_tv = {0, RATE_TICK_MS * 1000};
+    size_t rate = rate_per_tick(config.rate_limit);
+    return ev_token_bucket_cfg_new(rate, config.rate_burst, rate, config.rate_burst, &rate_tv);
+}
+
+struct ev_token_bucket_cfg *new_group_rate_cfg() {
+    struct timeval rate_tv = {0, RATE_TICK_MS * 1000};
+    size_t share = worker_rate_share();
+    size_t rate = rate_per_tick(share);
+    return ev_token_bucket_cfg_new(rate, share, rate, share, &rate_tv);
+}
+
+// How much a :8888 connection may read right now, 0 if it has to wait
+size_t conn_read_allowance(struct conn_state_t *state) {
+    struct worker_t *w = state->worker;
+    size_t allowed = config.read_buf_size;
+
+    if (config.rate_limit) {
+        const struct conn_limits_t *limits = get_conn_limits();
+        uint64_t ticks = w->rate_tick - state->refill_tick;
+        state->refill_tick = w->rate_tick;
+        if (ticks > 0) {
+            size_t refill = ticks * rate_per_tick(limits->rate_limit);
+            state->read_tokens = state->read_tokens + refill < limits->rate_burst
+                ? state->read_tokens + refill : limits->rate_burst;
+        }
+        allowed = allowed < state->read_tokens ? allowed : state->read_tokens;
+    }
+    if (w->rate_group) {
+        ev_ssize_t left = bufferevent_rate_limit_group_get_read_limit(w->rate_group);
+        if (left <= 0) {
+            return 0;
+        }
+        allowed = allowed < (size_t) left ? allowed : (size_t) left;
+    }
+    return allowed;
+}
+
+void conn_consume_tokens(struct conn_state_t *state, size_t n) {
+    if (config.rate_limit) {
+        state->read_tokens -= n;
+    }
+    if (state->worker->rate_group) {
+        bufferevent_rate_limit_group_decrement_read(state->worker->rate_group, n);
+    }
+}
+
+// Stop reading until the rate tick has topped up the buckets again
+void conn_throttle(struct conn_state_t *state) {
+    struct worker_t *w = state->worker;
+
+    event_del(&state->event_read_socket);
+    if (state->throttled) {
+        return;
+    }
+    state->throttled = 1;
+    state->throttled_prev = NULL;
+    state->throttled_next = w->throttled;
+    if (w->throttled) {
+        w->throttled->throttled_prev = state;
+    }
+    w->throttled = state;
+}
+
+void conn_unthrottle(struct conn_state_t *state) {
+    struct worker_t *w = state->worker;
+
+    if (state->throttled_prev) {
+        state->throttled_prev->throttled_next = state->throttled_next;
+    } else {
+        w->throttled = state->throttled_next;
+    }
+    if (state->throttled_next) {
+        state->throttled_next->throttled_prev = state->throttled_prev;
+    }
+    state->throttled = 0;
+}
+
+void cb_rate_tick(evutil_socket_t fd, short what, void *arg) {
+    struct worker_t *w = arg;
+
+    w->rate_tick++;
+
+    struct conn_state_t *state = w->throttled;
+    while (state) {
+        struct conn_state_t *next = state->throttled_next;
+        if (conn_read_allowance(state) > 0) {
+            conn_unthrottle(state);
+            if (!state->reading_paused && !w->draining) {
+                event_add(&state->event_read_socket, w->idle_timeout);
+            }
+        }
+        state = next;
+    }
+}
+
+uint64_t wheel_idle_ticks() {
+    return ((uint64_t) config.idle_timeout_s * 1000 + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+}
+
+void wheel_insert(struct worker_t *w, struct conn_state_t *state) {
+    int slot = state->idle_deadline % WHEEL_SLOTS;
+    state->wheel_slot = slot;
+    state->wheel_prev = NULL;
+    state->wheel_next = w->wheel[slot];
+    if (w->wheel[slot]) {
+        w->wheel[slot]->wheel_prev = state;
+    }
+    w->wheel[slot] = state;
+}
+
+void wheel_remove(struct worker_t *w, struct conn_state_t *state) {
+    if (state->wheel_slot < 0) {
+        return;
+    }
+    if (state->wheel_prev) {
+        state->wheel_prev->wheel_next = state->wheel_next;
+    } else {
+        w->wheel[state->wheel_slot] = state->wheel_next;
+    }
+    if (state->wheel_next) {
+        state->wheel_next->wheel_prev = state->wheel_prev;
+    }
+    state->wheel_slot = -1;
+}
+
+// Push a connection's idle deadline back. It stays in whatever slot it's in.
+void conn_touch(struct conn_state_t *state) {
+    if (config.timer_wheel) {
+        state->idle_deadline = state->worker->wheel_tick + wheel_idle_ticks();
+    }
+}
+
+// Start keeping track of a new connection
+void conn_start_idle_timer(struct conn_state_t *state) {
+    state->wheel_slot = -1;
+    if (config.timer_wheel) {
+        conn_touch(state);
+        wheel_insert(state->worker, state);
+    }
+}
+
+// Tear down a connection, whichever transport it uses, and give the slot back
+// to the pool. If there's a reason, it's logged.
+void close_conn(struct conn_state_t *state, const char *why) {
+    if (why) {
+        log_msg(LOG_INFO, "Peer %s:%d %s\n", state->addr, state->port, why);
+    }
+    wheel_remove(state->worker, state);
+    TRACE3(close, state->worker->id, state->fd, state->transport->kind);
+    if (state->worker->event_ring) {
+        event_log_close(state, why);
+    }
+    handler->on_close(state);
+    stat_add(&state->worker->stats.listeners[state->transport->kind].closed, 1);
+    state->transport->free(state);
+    free_conn_state(state);
+}
+
+struct evbuffer *conn_output(struct conn_state_t *state) {
+    return state->transport->output(state);
+}
+
+// Go through the slots for every tick up to now. A connection in one of them
+// has either timed out or was active since, in which case it moves on to the
+// slot for its new deadline. Each slot's list is taken off the wheel first,
+// since that can be the same slot again.
+void wheel_advance(struct worker_t *w, uint64_t now) {
+    uint64_t tick = now / (WHEEL_TICK_MS * 1000000ull);
+
+    // After a long stall one revolution visits every slot anyway
+    if (tick - w->wheel_tick > WHEEL_SLOTS) {
+        w->wheel_tick = tick - WHEEL_SLOTS;
+    }
+
+    while (w->wheel_tick < tick) {
+        w->wheel_tick++;
+        int slot = w->wheel_tick % WHEEL_SLOTS;
+        struct conn_state_t *state = w->wheel[slot];
+        w->wheel[slot] = NULL;
+
+        while (state) {
+            struct conn_state_t *next = state->wheel_next;
+            state->wheel_slot = -1;
+            if (state->idle_deadline <= w->wheel_tick) {
+                close_conn(state, "timed out");
+            } else {
+                wheel_insert(w, state);
+            }
+            state = next;
+        }
+    }
+}
+
+// Runs every LOG_FLUSH_INTERVAL_MS. How much later than that it actually runs
+// is a direct measure of how backed up the event loop is.
+void cb_worker_tick(evutil_socket_t fd, short what, void *arg) {
+    struct worker_t *w = arg;
+    uint64_t now = now_ns();
+
+    if (w->last_tick_ns) {
+        uint64_t expected = w->last_tick_ns + LOG_FLUSH_INTERVAL_MS * 1000000ull;
+        stat_hist_record(&w->stats.loop_lag_us, now > expected ? (now - expected) / 1000 : 0);
+    }
+    w->last_tick_ns = now;
+
+    // Connections closing on other workers make room for this one too
+    maybe_resume_accepting(w);
+    if (w->uring) {
+        uring_retry(w);
+    }
+    if (config.timer_wheel) {
+        wheel_advance(w, now);
+    }
+    log_flush();
+}
+
+// Format a peer address and port for logging into a caller supplied buffer,
+// which should be at least INET6_ADDRSTRLEN bytes
+void format_address(const struct sockaddr *sa, char *buf, size_t len, uint16_t *port) {
+    const void *addr = NULL;
+    *port = 0;
+
+    if (sa->sa_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in*) sa;
+        addr = &sin->sin_addr;
+        *port = ntohs(sin->sin_port);
+    } else if (sa->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*) sa;
+        addr = &sin6->sin6_addr;
+        *port = ntohs(sin6->sin6_port);
+    } else if (sa->sa_family == AF_UNIX) {
+        snprintf(buf, len, "unix");
+        return;
+    }
+
+    if (addr == NULL || inet_ntop(sa->sa_family, addr, buf, len) == NULL) {
+        snprintf(buf, len, "?");
+    }
+}
+
+// The address a connection came in on, written the way the listen options
+// take it
+void format_local_address(evutil_socket_t fd, char *buf, size_t len) {
+    struct sockaddr_storage ss;
+    socklen_t slen = sizeof(ss);
+    char addr[INET6_ADDRSTRLEN];
+    uint16_t port;
+
+    if (getsockname(fd, (struct sockaddr*) &ss, &slen) < 0) {
+        snprintf(buf, len, "?");
+        return;
+    }
+    if (ss.ss_family == AF_UNIX) {
+        int path_len = slen - offsetof(struct sockaddr_un, sun_path);
+        snprintf(buf, len, "unix:%.*s", path_len, ((struct sockaddr_un*) &ss)->sun_path);
+        return;
+    }
+    format_address((struct sockaddr*) &ss, addr, sizeof(addr), &port);
+    snprintf(buf, len, ss.ss_family == AF_INET6 ? "[%s]:%d" : "%s:%d", addr, port);
+}
+
+// Totals across all workers
+struct stats_summary_t {
+    uint64_t active;
+    uint64_t reads;
+    uint64_t bytes_read;
+    uint64_t tls_handshakes;
+    uint64_t tls_resumed;
+};
+
+void stats_summarize(struct stats_summary_t *sum) {
+    memset(sum, 0, sizeof(*sum));
+    for (int i = 0; i < config.num_threads; ++i) {
+        for (int l = 0; l < NUM_LISTENERS; ++l) {
+            struct listener_stats_t *ls = &workers[i].stats.listeners[l];
+            sum->active += stat_load(&ls->accepted) + stat_load(&ls->migrated_in) -
+                           stat_load(&ls->closed) - stat_load(&ls->migrated_out);
+            sum->reads += stat_load(&ls->reads);
+            sum->bytes_read += stat_load(&ls->bytes_read);
+        }
+        sum->tls_handshakes += stat_load(&workers[i].stats.tls_handshakes);
+        sum->tls_resumed += stat_load(&workers[i].stats.tls_resumed);
+    }
+}
+
+void metrics_add_hist(struct evbuffer *out, const char *name, const char *labels,
+                      const struct stat_hist_t *hists, int num_hists, size_t stride,
+                      double scale) {
+    uint64_t cumulative = 0;
+    for (int b = 0; b < STAT_HIST_BUCKETS; ++b) {
+        for (int i = 0; i < num_hists; ++i) {
+            const struct stat_hist_t *h = (const void*) ((const char*) hists + i * stride);
+            cumulative += stat_load(&h->buckets[b]);
+        }
+        if (b < STAT_HIST_BUCKETS - 1) {
+            evbuffer_add_printf(out, "%s_bucket{%s%sle=\"%.15g\"} %lu\n", name, labels,
+                                *labels ? "," : "", (double) (1ull << b) * scale, cumulative);
+        } else {
+            evbuffer_add_printf(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels,
+                                *labels ? "," : "", cumulative);
+        }
+    }
+
+    uint64_t sum = 0;
+    for (int i = 0; i < num_hists; ++i) {
+        const struct stat_hist_t *h = (const void*) ((const char*) hists + i * stride);
+        sum += stat_load(&h->sum);
+    }
+    const char *sep = *labels ? "{" : "";
+    const char *end = *labels ? "}" : "";
+    evbuffer_add_printf(out, "%s_sum%s%s%s %.15g\n", name, sep, labels, end, sum * scale);
+    evbuffer_add_printf(out, "%s_count%s%s%s %lu\n", name, sep, labels, end, cumulative);
+}
+
+// Prometheus text exposition of all workers' stats. Counters are per worker and
+// listener, histograms are summed over the workers.
+void cb_metrics(struct evhttp_request *req, void *arg) {
+    struct evbuffer *out = evbuffer_new();
+
+    static const struct {
+        const char *name;
+        const char *type;
+        const char *help;
+        size_t offset;
+    } counters[] = {
+        {"server_connections_accepted_total", "counter", "Accepted connections",
+         offsetof(struct listener_stats_t, accepted)},
+        {"server_connections_closed_total", "counter", "Closed connections",
+         offsetof(struct listener_stats_t, closed)},
+        {"server_connections_rejected_total", "counter",
+         "Connections closed right away because of the per address or global limit",
+         offsetof(struct listener_stats_t, rejected)},
+        {"server_reads_total", "counter", "Reads from connections",
+         offsetof(struct listener_stats_t, reads)},
+        {"server_read_bytes_total", "counter", "Bytes read from connections",
+         offsetof(struct listener_stats_t, bytes_read)},
+        {"server_connections_migrated_in_total", "counter",
+         "Connections moved to this worker by the balancer",
+         offsetof(struct listener_stats_t, migrated_in)},
+        {"server_connections_migrated_out_total", "counter",
+         "Connections moved away from this worker by the balancer",
+         offsetof(struct listener_stats_t, migrated_out)},
+    };
+
+    for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); ++c) {
+        evbuffer_add_printf(out, "# HELP %s %s\n# TYPE %s %s\n", counters[c].name,
+                            counters[c].help, counters[c].name, counters[c].type);
+        for (int i = 0; i < config.num_threads; ++i) {
+            for (int l = 0; l < NUM_LISTENERS; ++l) {
+                const char *ls = (const char*) &workers[i].stats.listeners[l];
+                evbuffer_add_printf(out, "%s{listener=\"%s\",worker=\"%d\"} %lu\n",
+                                    counters[c].name, LISTENER_NAMES[l], i,
+                                    stat_load((const uint64_t*) (ls + counters[c].offset)));
+            }
+        }
+    }
+
+    evbuffer_add_printf(out, "# HELP server_connections_active Open connections\n"
+                        "# TYPE server_connections_active gauge\n");
+    for (int i = 0; i < config.num_threads; ++i) {
+        for (int l = 0; l < NUM_LISTENERS; ++l) {
+            struct listener_stats_t *ls = &workers[i].stats.listeners[l];
+            evbuffer_add_printf(out, "server_connections_active{listener=\"%s\",worker=\"%d\"} %lu\n",
+                                LISTENER_NAMES[l], i,
+                                stat_load(&ls->accepted) + stat_load(&ls->migrated_in) -
+                                stat_load(&ls->closed) - stat_load(&ls->migrated_out));
+        }
+    }
+
+    size_t stride = sizeof(struct worker_t);
+
+    evbuffer_add_printf(out, "# HELP server_read_size_bytes Size of individual reads\n"
+                        "# TYPE server_read_size_bytes histogram\n");
+    metrics_add_hist(out, "server_read_size_bytes", "", &workers[0].stats.read_size,
+                     config.num_threads, stride, 1);
+
+#ifdef CB_TIMING
+    evbuffer_add_printf(out, "# HELP server_callback_duration_seconds Time spent in callbacks\n"
+                        "# TYPE server_callback_duration_seconds histogram\n");
+    for (int cb = 0; cb < NUM_CALLBACKS; ++cb) {
+        char labels[64];
+        snprintf(labels, sizeof(labels), "callback=\"%s\"", CALLBACK_NAMES[cb]);
+        metrics_add_hist(out, "server_callback_duration_seconds", labels,
+                         &workers[0].stats.callback_us[cb], config.num_threads, stride, 1e-6);
+    }
+#endif
+
+    if (ssl_ctx) {
+        static const struct {
+            const char *name;
+            const char *help;
+            size_t offset;
+        } tls_counters[] = {
+            {"server_tls_handshakes_total", "Completed TLS handshakes, including resumed ones",
+             offsetof(struct stats_t, tls_handshakes)},
+            {"server_tls_resumed_total", "TLS handshakes that resumed an earlier session",
+             offsetof(struct stats_t, tls_resumed)},
+            {"server_tls_handshake_failures_total", "Connections closed before their handshake finished",
+             offsetof(struct stats_t, tls_failed)},
+        };
+        for (size_t c = 0; c < sizeof(tls_counters) / sizeof(tls_counters[0]); ++c) {
+            evbuffer_add_printf(out, "# HELP %s %s\n# TYPE %s counter\n", tls_counters[c].name,
+                                tls_counters[c].help, tls_counters[c].name);
+            for (int i = 0; i < config.num_threads; ++i) {
+                const char *st = (const char*) &workers[i].stats;
+                evbuffer_add_printf(out, "%s{worker=\"%d\"} %lu\n", tls_counters[c].name, i,
+                                    stat_load((const uint64_t*) (st + tls_counters[c].offset)));
+            }
+        }
+
+        evbuffer_add_printf(out, "# HELP server_tls_handshake_seconds Time from accept to a finished handshake\n"
+                            "# TYPE server_tls_handshake_seconds histogram\n");
+        metrics_add_hist(out, "server_tls_handshake_seconds", "", &workers[0].stats.tls_handshake_us,
+                         config.num_threads, stride, 1e-6);
+    }
+
+    if (config.event_log) {
+        evbuffer_add_printf(out, "# HELP server_event_log_dropped_total Event log records dropped because the writer fell behind\n"
+                            "# TYPE server_event_log_dropped_total counter\n");
+        for (int i = 0; i < config.num_threads; ++i) {
+            evbuffer_add_printf(out, "server_event_log_dropped_total{worker=\"%d\"} %lu\n", i,
+                                stat_load(&workers[i].stats.event_log_dropped));
+        }
+    }
+
+    evbuffer_add_printf(out, "# HELP server_loop_lag_seconds How late the periodic tick runs\n"
+                        "# TYPE server_loop_lag_seconds histogram\n");
+    metrics_add_hist(out, "server_loop_lag_seconds", "", &workers[0].stats.loop_lag_us,
+                     config.num_threads, stride, 1e-6);
+
+    if (config.loop_once) {
+        evbuffer_add_printf(out, "# HELP server_loop_callbacks Connection callbacks run per loop iteration\n"
+                            "# TYPE server_loop_callbacks histogram\n");
+        metrics_add_hist(out, "server_loop_callbacks", "", &workers[0].stats.loop_callbacks,
+                         config.num_threads, stride, 1);
+    }
+
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                      "text/plain; version=0.0.4");
+    evhttp_send_reply(req, HTTP_OK, "OK", out);
+    evbuffer_free(out);
+}
+
+void cb_shutdown(evutil_socket_t signum, short what, void *arg) {
+    static int signalled;
+    const char *name = signum == SIGTERM ? "SIGTERM" : "SIGINT";
+
+    if (signalled++) {
+        log_msg(LOG_INFO, "Got %s again - closing all connections now!\n", name);
+    } else {
+        log_msg(LOG_INFO, "Got %s - draining connections for up to %ds!\n",
+                name, config.grace_period_s);
+    }
+
+    // Stop handing out new connections, then have each worker start draining
+    // on its own thread, since signals are only delivered to the main
+    // thread's base
+    if (acceptor) {
+        event_base_loopexit(acceptor->base, NULL);
+    }
+    for (int i = 0; i < config.num_threads; ++i) {
+        event_active(workers[i].event_drain, EV_READ, 0);
+    }
+}
+
+// The application: log what comes in, then echo it back or drop it. The
+// stream handler does that with whatever each read returns, the frame handler
+// frame by frame.
+// The listener is named by where it's actually bound, which needn't be the
+// default port
+void app_on_accept(struct conn_state_t *state) {
+    if (LOG_ENABLED(LOG_INFO)) {
+        char local[128];
+        format_local_address(state->fd, local, sizeof(local));
+        log_msg(LOG_INFO, "Got incoming connection on %s!\n", local);
+    }
+}
+
+void app_on_close(struct conn_state_t *state) {
+    log_conn_suppressed(state);
+}
+
+int stream_on_data(struct conn_state_t *state, struct evbuffer *input, size_t num_read) {
+    // Look at the data in place in the evbuffer's chains rather than copying
+    // it out
+    if (LOG_ENABLED(LOG_DEBUG)) {
+        struct evbuffer_iovec vec[4];
+        int n_vec = evbuffer_peek(input, LOG_HEXDUMP_MAX, NULL, vec, 4);
+        log_data(state, "Read", num_read, vec, n_vec < 4 ? n_vec : 4);
+    }
+
+    // Then either throw it away or move the chains over to the output buffer,
+    // rather than copying the bytes
+    if (config.echo) {
+        evbuffer_add_buffer(conn_output(state), input);
+    } else {
+        evbuffer_drain(input, evbuffer_get_length(input));
+    }
+    return 0;
+}
+
+void frame_on_accept(struct conn_state_t *state) {
+    app_on_accept(state);
+    // Nothing can be done before there's a whole frame header to look at
+    if (config.framing == FRAMING_LENGTH) {
+        state->read_low_wm = FRAME_HEADER_LEN;
+    }
+}
+
+// A complete frame sits at the front of the input buffer: header_len bytes of
+// header, then payload_len bytes of payload, then frame_len in total including
+// any trailer. It's looked at in place and then either dropped or, in echo
+// mode, moved to the output buffer as is.
+void on_frame(struct conn_state_t *state, struct evbuffer *input,
+              size_t header_len, size_t payload_len, size_t frame_len) {
+    if (LOG_ENABLED(LOG_DEBUG)) {
+        struct evbuffer_ptr payload;
+        evbuffer_ptr_set(input, &payload, header_len, EVBUFFER_PTR_SET);
+
+        struct evbuffer_iovec vec[4];
+        int n_vec = evbuffer_peek(input, payload_len < LOG_HEXDUMP_MAX ? payload_len : LOG_HEXDUMP_MAX,
+                                  &payload, vec, 4);
+        log_data(state, "Frame of", payload_len, vec, n_vec < 4 ? n_vec : 4);
+    }
+
+    if (config.echo) {
+        evbuffer_remove_buffer(input, conn_output(state), frame_len);
+    } else {
+        evbuffer_drain(input, frame_len);
+    }
+}
+
+// Hand every complete frame at the front of the input buffer to on_frame and
+// leave a partial one where it is until the rest arrives. Returns -1 if the
+// connection should be closed.
+int read_frames(struct conn_state_t *state, struct evbuffer *input) {
+    // Anything left over from last time is known not to contain a newline, so
+    // only search what is new
+    size_t scan_from = state->input_seen;
+    size_t low_wm = config.framing == FRAMING_LENGTH ? FRAME_HEADER_LEN : 0;
+
+    for (;;) {
+        size_t len = evbuffer_get_length(input);
+        size_t header_len, payload_len, frame_len;
+
+        if (config.framing == FRAMING_LINE) {
+            struct evbuffer_ptr start;
+            evbuffer_ptr_set(input, &start, scan_from, EVBUFFER_PTR_SET);
+
+            size_t eol_len;
+            struct evbuffer_ptr eol = evbuffer_search_eol(input, &start, &eol_len,
+                                                          EVBUFFER_EOL_LF);
+            if (eol.pos < 0) {
+                if (len > config.max_frame_size) {
+                    goto too_long;
+                }
+                break;
+            }
+            header_len = 0;
+            payload_len = eol.pos;
+            frame_len = eol.pos + eol_len;
+        } else {
+            if (len < FRAME_HEADER_LEN) {
+                break;
+            }
+
+            uint32_t header;
+            evbuffer_copyout(input, &header, FRAME_HEADER_LEN);
+            header_len = FRAME_HEADER_LEN;
+            payload_len = ntohl(header);
+            frame_len = header_len + payload_len;
+            if (payload_len > config.max_frame_size) {
+                goto too_long;
+            }
+
+            // Don't wake up again until the whole frame is in
+            if (len < frame_len) {
+                low_wm = frame_len;
+                break;
+            }
+        }
+
+        on_frame(state, input, header_len, payload_len, frame_len);
+        scan_from = 0;
+    }
+
+    state->read_low_wm = low_wm;
+    return 0;
+
+too_long:
+    log_msg(LOG_INFO, "Peer %s:%d sent a frame over %zu bytes, disconnecting\n",
+            state->addr, state->port, config.max_frame_size);
+    return -1;
+}
+
+int frame_on_data(struct conn_state_t *state, struct evbuffer *input, size_t num_read) {
+    return read_frames(state, input);
+}
+
+const struct conn_handler_t STREAM_HANDLER = {
+    .on_accept = app_on_accept,
+    .on_data = stream_on_data,
+    .on_close = app_on_close,
+};
+
+const struct conn_handler_t FRAME_HANDLER = {
+    .on_accept = frame_on_accept,
+    .on_data = frame_on_data,
+    .on_close = app_on_close,
+};
+
+// Hand what a transport has just read to the handler. Returns -1 if the
+// connection was closed.
+int conn_received(struct conn_state_t *state, struct evbuffer *input, size_t num_read) {
+    TRACE3(read, state->worker->id, state->fd, num_read);
+    state->balance_bytes += num_read;
+    conn_touch(state);
+    if (state->worker->event_ring) {
+        event_log_read(state, num_read);
+    }
+    if (handler->on_data(state, input, num_read) < 0) {
+        close_conn(state, NULL);
+        return -1;
+    }
+    state->input_seen = evbuffer_get_length(input);
+    return 0;
+}
+
+// Make sure queued replies get written out, and stop reading from a peer that
+// isn't keeping up with its replies
+void conn_schedule_write(struct conn_state_t *state) {
+    size_t len = evbuffer_get_length(state->output);
+    if (len == 0) {
+        return;
+    }
+
+    if (!event_pending(&state->event_write_socket, EV_WRITE, NULL)) {
+        event_add(&state->event_write_socket, state->worker->idle_timeout);
+    }
+    if (len >= get_conn_limits()->write_high_wm && !state->reading_paused) {
+        raw_stop_reading(state);
+        state->reading_paused = 1;
+    }
+}
+
+void write_socket(evutil_socket_t fd, short what, void *arg) {
+    struct conn_state_t *state = arg;
+    struct evbuffer *output = state->output;
+
+    if (what & EV_TIMEOUT) {
+        close_conn(state, "timed out");
+        return;
+    }
+
+    // The write event is edge triggered, so keep going until everything is out
+    // or the socket buffer is full, otherwise we might not hear from it again
+    while (evbuffer_get_length(output) > 0) {
+        if (evbuffer_write(output, fd) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
+            }
+            perror("Failed to write to socket\n");
+            close_conn(state, "disconnected");
+            return;
+        }
+        conn_touch(state);
+    }
+
+    size_t len = evbuffer_get_length(output);
+    if (len == 0) {
+        event_del(&state->event_write_socket);
+        if (state->worker->draining) {
+            close_conn(state, NULL);
+            return;
+        }
+    }
+    if (state->reading_paused && len <= get_conn_limits()->write_low_wm &&
+        !state->worker->draining) {
+        raw_start_reading(state);
+        state->reading_paused = 0;
+    }
+}
+
+void cb_write_socket(evutil_socket_t fd, short what, void *arg) {
+    struct worker_t *w = ((struct conn_state_t*) arg)->worker;
+    uint64_t start_ns = callback_start_ns();
+    write_socket(fd, what, arg);
+    stats_record_callback(w, CB_WRITE_SOCKET, start_ns);
+}
+
+void read_socket(evutil_socket_t fd, short what, void *arg) {
+    struct conn_state_t *state = arg;
+
+    // The read event is persistent, so its timeout restarts every time the
+    // peer sends something and only fires once it has been idle for that long
+    if (what & EV_TIMEOUT) {
+        close_conn(state, "timed out");
+        return;
+    }
+
+    // Keep reading until the socket is drained, but only up to the read budget
+    // so that a single busy peer can't starve the other connections. Whatever
+    // is left over makes the event fire again on the next loop iteration.
+    for (int i = 0; i < config.read_budget; ++i) {
+        size_t want = conn_read_allowance(state);
+        if (want == 0) {
+            conn_throttle(state);
+            break;
+        }
+        struct read_buf_t *buf = read_buf_get(&state->worker->read_pool);
+        if (buf == NULL) {
+            close_conn(state, NULL);
+            return;
+        }
+        ssize_t num_read = recv(fd, buf->data, want, 0);
+
+        if (num_read < 1) {
+            read_buf_put(buf);
+        }
+        if (num_read < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
+            }
+            perror("Failed to read from socket\n");
+        }
+
+        // There was actually nothing to read. We assume this means the peer
+        // disconnected so we remove the read event.
+        if (num_read < 1) {
+            close_conn(state, "disconnected");
+            return;
+        }
+
+        if (read_buf_add(state->input, buf, num_read) < 0) {
+            perror("Failed to add to input buffer\n");
+            close_conn(state, NULL);
+            return;
+        }
+        conn_consume_tokens(state, num_read);
+        stats_record_read(state->worker, LISTENER_RAW, num_read);
+        if (conn_received(state, state->input, num_read) < 0) {
+            return;
+        }
+
+        // A short read means the socket buffer is empty, so skip the recv()
+        // that would just return EAGAIN
+        if ((size_t) num_read < want) {
+            break;
+        }
+    }
+
+    // Replies to everything read in this callback go out together
+    if (state->output) {
+        conn_schedule_write(state);
+    }
+}
+
+void cb_read_socket(evutil_socket_t fd, short what, void *arg) {
+    struct worker_t *w = ((struct conn_state_t*) arg)->worker;
+    uint64_t start_ns = callback_start_ns();
+    read_socket(fd, what, arg);
+    stats_record_callback(w, CB_READ_SOCKET, start_ns);
+}
+
+int set_int_option(evutil_socket_t fd, int level, int name, int value, const char *what) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+        fprintf(stderr, "Failed to set %s: %s\n", what, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Set the TCP options asked for on a listening socket. Linux copies all of
+// these to the sockets it accepts, so they're set once here rather than on
+// every connection. Buffer sizes have to be set before listen() for the
+// window scale to be picked from them.
+int set_tcp_listener_options(evutil_socket_t fd) {
+    if (config.nodelay && set_int_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY") < 0) {
+        return -1;
+    }
+    if (config.rcvbuf && set_int_option(fd, SOL_SOCKET, SO_RCVBUF, config.rcvbuf, "SO_RCVBUF") < 0) {
+        return -1;
+    }
+    if (config.sndbuf && set_int_option(fd, SOL_SOCKET, SO_SNDBUF, config.sndbuf, "SO_SNDBUF") < 0) {
+        return -1;
+    }
+    // Only wake up the listener once a connection has sent some data
+    if (config.defer_accept_s &&
+        set_int_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, config.defer_accept_s,
+                       "TCP_DEFER_ACCEPT") < 0) {
+        return -1;
+    }
+    if (config.fastopen_qlen &&
+        set_int_option(fd, IPPROTO_TCP, TCP_FASTOPEN, config.fastopen_qlen, "TCP_FASTOPEN") < 0) {
+        return -1;
+    }
+    if (config.busy_poll_us &&
+        set_int_option(fd, SOL_SOCKET, SO_BUSY_POLL, config.busy_poll_us, "SO_BUSY_POLL") < 0) {
+        return -1;
+    }
+    if (config.keepalive_idle_s) {
+        if (set_int_option(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE") < 0 ||
+            set_int_option(fd, IPPROTO_TCP, TCP_KEEPIDLE, config.keepalive_idle_s,
+                           "TCP_KEEPIDLE") < 0 ||
+            set_int_option(fd, IPPROTO_TCP, TCP_KEEPINTVL, config.keepalive_intvl_s,
+                           "TCP_KEEPINTVL") < 0 ||
+            set_int_option(fd, IPPROTO_TCP, TCP_KEEPCNT, config.keepalive_cnt,
+                           "TCP_KEEPCNT") < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// TCP_QUICKACK is the exception: it isn't inherited, and the kernel can turn
+// it off again by itself, so it's set on each accepted socket
+void set_tcp_conn_options(evutil_socket_t fd, const struct sockaddr *peer) {
+    if (config.quickack && peer->sa_family != AF_UNIX) {
+        int enabled = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &enabled, sizeof(enabled));
+    }
+}
+
+struct evbuffer *raw_output(struct conn_state_t *state) {
+    return state->output;
+}
+
+void raw_drain(struct conn_state_t *state) {
+    raw_stop_reading(state);
+    if (state->output == NULL || evbuffer_get_length(state->output) == 0) {
+        close_conn(state, NULL);
+    }
+}
+
+// Stop watching the socket and close it. A recv still in the ring holds on to
+// the socket until it's cancelled, either now, from uring_retry once the queue
+// has room, or by reap_uring when it next completes. Anything it completes
+// after this has the old generation.
+void raw_free(struct conn_state_t *state) {
+    raw_stop_reading(state);
+    state->uring_gen++;
+    if (state->throttled) {
+        conn_unthrottle(state);
+    }
+    if (state->output) {
+        event_del(&state->event_write_socket);
+        evbuffer_free(state->output);
+    }
+    evbuffer_free(state->input);
+    evutil_closesocket(state->fd);
+}
+
+const struct transport_t RAW_TRANSPORT = {
+    .kind = LISTENER_RAW,
+    .output = raw_output,
+    .drain = raw_drain,
+    .free = raw_free,
+};
+
+// Set up the events of a :8888 connection on its worker's base
+void raw_assign_events(struct conn_state_t *state) {
+    struct worker_t *w = state->worker;
+
+    if (state->output) {
+        event_assign(&state->event_write_socket, w->base, state->fd,
+                     EV_WRITE | EV_PERSIST | EV_ET, cb_write_socket, (void*) state);
+        event_priority_set(&state->event_write_socket, PRIO_CONN);
+    }
+
+    // Add a new event that waits until we can read from the socket. With
+    // io_uring it's only a timer for the idle timeout.
+    if (w->uring) {
+        event_assign(&state->event_read_socket, w->base, -1, EV_PERSIST,
+                     cb_read_socket, (void*) state);
+    } else {
+        event_assign(&state->event_read_socket, w->base, state->fd, EV_READ | EV_PERSIST,
+                     cb_read_socket, (void*) state);
+    }
+    event_priority_set(&state->event_read_socket, PRIO_CONN);
+}
+
+// Set up a :8888 connection once it has been accepted, whichever way that was
+void raw_conn_setup(struct conn_state_t *state) {
+    struct worker_t *w = state->worker;
+    int fd = state->fd;
+
+    set_tcp_conn_options(fd, (struct sockaddr*) &state->peer);
+    format_address((struct sockaddr*) &state->peer, state->addr, sizeof(state->addr),
+                   &state->port);
+
+    int admitted = admit_peer(state, (struct sockaddr*) &state->peer);
+    if (admitted < 0) {
+        log_msg(LOG_DEBUG, "Rejecting %s:%d, %s\n", state->addr, state->port,
+                admitted == IP_TABLE_FULL ? "the address table is full"
+                                          : "too many connections from that address");
+        stat_add(&w->stats.listeners[LISTENER_RAW].rejected, 1);
+        evutil_closesocket(fd);
+        free_conn_state(state);
+        return;
+    }
+
+    state->input = evbuffer_new();
+    state->output = config.echo ? evbuffer_new() : NULL;
+    if (state->input == NULL || (config.echo && state->output == NULL)) {
+        perror("Failed to create connection buffers\n");
+        if (state->input) {
+            evbuffer_free(state->input);
+        }
+        if (state->output) {
+            evbuffer_free(state->output);
+        }
+        evutil_closesocket(fd);
+        free_conn_state(state);
+        return;
+    }
+
+    state->transport = &RAW_TRANSPORT;
+    state->read_tokens = get_conn_limits()->rate_burst;
+    state->refill_tick = w->rate_tick;
+
+    // Nothing is read before this returns, so reading can start ahead of the
+    // handler. A connection that can't be read from is let go before anyone
+    // has heard of it and so isn't counted as accepted or closed.
+    raw_assign_events(state);
+    if (raw_start_reading(state)) {
+        perror("Failed to add read socket event\n");
+        raw_free(state);
+        free_conn_state(state);
+        return;
+    }
+
+    stat_add(&w->stats.listeners[LISTENER_RAW].accepted, 1);
+    TRACE3(accept, w->id, fd, LISTENER_RAW);
+    state->accepted_ns = now_ns();
+    if (w->event_ring) {
+        event_log_accept(state);
+    }
+    state->balance_ns = state->accepted_ns;
+    conn_start_idle_timer(state);
+    handler->on_accept(state);
+}
+
+void accept_conn(evutil_socket_t listener, short what, void *arg) {
+    struct worker_t *w = arg;
+
+    // Accept everything that is queued up, but at most config.accept_batch
+    // connections per wakeup so reads on existing connections still get a turn
+    for (int i = 0; i < config.accept_batch; ++i) {
+        struct conn_state_t *state = alloc_conn_state(w);
+        if (state == NULL) {
+            return;
+        }
+        // Leave connections over the cap in the kernel's accept queue
+        if (admit_conn(state) < 0) {
+            free_conn_state(state);
+            return;
+        }
+        socklen_t slen = sizeof(state->peer);
+
+        // accept4 hands back a socket that is already nonblocking, which saves
+        // a couple of fcntl() calls per connection
+        int fd = accept4(listener, (struct sockaddr*) &state->peer, &slen,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            free_conn_state(state);
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return; // the accept queue is empty
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("Failed to accept connection\n");
+            return;
+        }
+        state->fd = fd;
+        raw_conn_setup(state);
+    }
+}
+
+void cb_accept_conn(evutil_socket_t listener, short what, void *arg) {
+    struct worker_t *w = arg;
+    uint64_t start_ns = callback_start_ns();
+    accept_conn(listener, what, arg);
+    stats_record_callback(w, CB_ACCEPT_CONN, start_ns);
+}
+
+// The kernel has already accepted this one, so unlike accept_conn a
+// connection over the cap can't be left in the queue and is closed instead
+void uring_accepted(struct worker_t *w, int fd) {
+    struct conn_state_t *state = alloc_conn_state(w);
+    if (state == NULL) {
+        close(fd);
+        return;
+    }
+    if (w->draining || admit_conn(state) < 0) {
+        stat_add(&w->stats.listeners[LISTENER_RAW].rejected, 1);
+        close(fd);
+        free_conn_state(state);
+        return;
+    }
+    // The peer may have reset it already, and without an address it can't
+    // be held to the per address limit anyway
+    socklen_t slen = sizeof(state->peer);
+    if (getpeername(fd, (struct sockaddr*) &state->peer, &slen) < 0) {
+        if (errno != ENOTCONN) {
+            perror("Failed to get peer address\n");
+        }
+        close(fd);
+        free_conn_state(state);
+        return;
+    }
+    state->fd = fd;
+    raw_conn_setup(state);
+}
+
+void uring_accept_done(struct worker_t *w, int i, const struct io_uring_cqe *cqe) {
+    struct uring_t *u = w->uring;
+
+    if (cqe->res >= 0) {
+        uring_accepted(w, cqe->res);
+    } else if (cqe->res != -ECANCELED) {
+        errno = -cqe->res;
+        perror("Failed to accept connection\n");
+    }
+    // Accepting may have been turned back on while the cancel was in flight,
+    // in which case it's re-armed straight away like after a success. Errors
+    // wait for the tick.
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        u->accept_armed[i] = 0;
+        u->accept_cancelling[i] = 0;
+        if (u->accept_wanted[i] && (cqe->res >= 0 || cqe->res == -ECANCELED)) {
+            uring_start_accept(w, i);
+        }
+    }
+}
+
+void uring_recv_done(struct worker_t *w, struct conn_state_t *state,
+                     const struct io_uring_cqe *cqe) {
+    struct uring_t *u = w->uring;
+    int res = cqe->res;
+
+    // With io_uring this is what stands in for a connection's read callback
+    w->iteration_callbacks++;
+
+    // The last completion of this recv, successful or not
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        state->recv = RECV_IDLE;
+    }
+
+    if (res > 0) {
+        // Copy out of the ring's buffer so it can go straight back. Data that
+        // arrives after a cancel is still the peer's, so it's kept too.
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        int added = evbuffer_add(state->input, uring_buf(u, bid), res);
+        uring_recycle(u, bid);
+        if (added < 0) {
+            perror("Failed to add to input buffer\n");
+            close_conn(state, NULL);
+            return;
+        }
+        if (w->idle_timeout && state->recv_wanted) {
+            event_add(&state->event_read_socket, w->idle_timeout);
+        }
+        stats_record_read(w, LISTENER_RAW, res);
+        if (conn_received(state, state->input, res) < 0) {
+            return;
+        }
+        if (state->output) {
+            conn_schedule_write(state);
+        }
+    } else if (res == 0) {
+        close_conn(state, "disconnected");
+        return;
+    } else if (res == -ENOBUFS) {
+        // Every buffer was in use. They're recycled as their completions are
+        // reaped, so the recv is re-armed by uring_retry once this batch is
+        // done rather than now, when it would likely find none again.
+        w->uring->stalled = 1;
+        return;
+    } else if (res != -ECANCELED) {
+        errno = -res;
+        perror("Failed to read from socket\n");
+        close_conn(state, "disconnected");
+        return;
+    }
+
+    if (state->recv == RECV_IDLE && state->recv_wanted) {
+        uring_start_recv(state);
+    }
+}
+
+// Reap what the kernel has completed, up to a budget so the other events get
+// a turn too. If that leaves any, the event is activated again by hand since
+// the eventfd won't be signalled for them.
+void reap_uring(evutil_socket_t fd, short what, void *arg) {
+    struct worker_t *w = arg;
+    struct uring_t *u = w->uring;
+    eventfd_t count;
+    int reaped = 0;
+
+    eventfd_read(fd, &count);
+    u->in_callback = 1;
+
+    unsigned head = *u->cq_head;
+    while (reaped < URING_CQE_BUDGET && head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe = u->cqes[head & *u->cq_mask];
+        __atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+        reaped++;
+
+        if (cqe.user_data == 0) {
+            continue;   // a cancel
+        }
+        if (cqe.user_data <= MAX_LISTEN_ADDRS) {
+            uring_accept_done(w, cqe.user_data - 1, &cqe);
+            continue;
+        }
+
+        struct conn_state_t *state = (struct conn_state_t*) (uintptr_t)
+            (cqe.user_data & URING_PTR_MASK);
+        if (state->uring_gen != (uint16_t) (cqe.user_data >> URING_GEN_SHIFT)) {
+            // The connection has been closed since. A recv that's still armed
+            // is cancelled, or it would keep the old socket open, and after
+            // enough reuses of the slot its generation would match again.
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                uring_recycle(u, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            if (cqe.flags & IORING_CQE_F_MORE) {
+                uring_cancel_later(u, cqe.user_data);
+            }
+            continue;
+        }
+        uring_recv_done(w, state, &cqe);
+    }
+
+    u->in_callback = 0;
+    if (__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+        // Completions that didn't fit are flushed into the ring by this
+        syscall(__NR_io_uring_enter, u->fd, 0, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+    uring_submit(u);
+    if (u->stalled) {
+        uring_retry(w);
+    }
+    if (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        event_active(u->event, EV_READ, 0);
+    }
+}
+
+void cb_uring(evutil_socket_t fd, short what, void *arg) {
+    struct worker_t *w = arg;
+    uint64_t start_ns = callback_start_ns();
+    reap_uring(fd, what, arg);
+    stats_record_callback(w, CB_URING, start_ns);
+}
+
+// Returns NULL if the kernel can't do what's needed here, and the caller
+// falls back to the read events
+struct uring_t *uring_new(struct worker_t *w) {
+    struct uring_t *u = calloc(1, sizeof(struct uring_t));
+    if (u == NULL) {
+        return NULL;
+    }
+    u->fd = -1;
+    u->event_fd = -1;
+
+    if (uring_setup_rings(u) < 0) {
+        goto fail;
+    }
+    if (!uring_supported(u)) {
+        errno = ENOSYS;
+        goto fail;
+    }
+    if (uring_setup_bufs(u) < 0) {
+        goto fail;
+    }
+    u->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (u->event_fd < 0 ||
+        syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_EVENTFD, &u->event_fd, 1) < 0) {
+        goto fail;
+    }
+    u->event = event_new(w->base, u->event_fd, EV_READ | EV_PERSIST, cb_uring, (void *)w);
+    if (u->event == NULL) {
+        goto fail;
+    }
+    event_priority_set(u->event, PRIO_CONN);
+    if (event_add(u->event, NULL)) {
+        goto fail;
+    }
+    return u;
+
+fail:
+    log_msg(LOG_INFO, "Worker %d can't use io_uring (%s), reading :8888 with %s instead\n",
+            w->id, strerror(errno), event_base_get_method(w->base));
+    uring_free(u);
+    return NULL;
+}
+
+void cb_lev_event(struct bufferevent *bev, short events, void *ctx) {
+    struct conn_state_t *state = ctx;
+
+    // An accepting TLS bufferevent reports the end of the handshake like this
+    if (events & BEV_EVENT_CONNECTED) {
+        struct stats_t *stats = &state->worker->stats;
+        int resumed = SSL_session_reused(bufferevent_openssl_get_ssl(bev));
+
+        state->handshake_done = 1;
+        stat_add(&stats->tls_handshakes, 1);
+        stat_add(&stats->tls_resumed, resumed);
+        stat_hist_record(&stats->tls_handshake_us, (now_ns() - state->accepted_ns) / 1000);
+        log_msg(LOG_DEBUG, "Peer %s:%d finished a %s TLS handshake\n", state->addr, state->port,
+                resumed ? "resumed" : "full");
+        return;
+    }
+    if (events & BEV_EVENT_TIMEOUT) {
+        close_conn(state, "timed out");
+        return;
+    }
+    if (events & BEV_EVENT_ERROR) {
+        unsigned long err = ssl_ctx ? bufferevent_get_openssl_error(bev) : 0;
+        if (err) {
+            log_msg(LOG_INFO, "TLS error from %s:%d: %s\n", state->addr, state->port,
+                    ERR_reason_error_string(err));
+        } else {
+            perror("Error from bufferevent\n");
+        }
+    }
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        close_conn(state, "disconnected");
+    }
+}
+
+// Called once a paused connection's output has drained to the low watermark,
+// or when draining, once it is empty
+void cb_lev_write_socket(struct bufferevent *bev, void *ctx) {
+    struct conn_state_t *state = ctx;
+
+    if (state->worker->draining) {
+        close_conn(state, NULL);
+        return;
+    }
+    conn_touch(state);
+    if (!(bufferevent_get_enabled(bev) & EV_READ)) {
+        bufferevent_enable(bev, EV_READ);
+    }
+}
+
+// libevent can read several times before the read callback runs, e.g. while
+// the input is below its low watermark, so reads are counted as they land.
+// The bufferevent's callback argument is the connection, wherever it's moved.
+void lev_input_added(struct evbuffer *input, const struct evbuffer_cb_info *info, void *arg) {
+    struct conn_state_t *state;
+
+    if (info->n_added == 0) {
+        return;
+    }
+    bufferevent_getcb(arg, NULL, NULL, NULL, (void**) &state);
+    stats_record_read(state->worker, LISTENER_LEV, info->n_added);
+}
+
+void lev_read_socket(struct bufferevent *bev, void *ctx) {
+    struct conn_state_t *state = ctx;
+    struct evbuffer *input = bufferevent_get_input(bev);
+
+    // Whatever the handler left behind last time has already been counted
+    size_t num_read = evbuffer_get_length(input) - state->input_seen;
+    if (conn_received(state, input, num_read) < 0) {
+        return;
+    }
+
+    // Don't wake up again until there's as much as the handler needs
+    bufferevent_setwatermark(bev, EV_READ, state->read_low_wm, 0);
+
+    // Stop reading if the peer isn't keeping up with its replies
+    if (config.echo &&
+        evbuffer_get_length(bufferevent_get_output(bev)) >= get_conn_limits()->write_high_wm) {
+        bufferevent_disable(bev, EV_READ);
+    }
+}
+
+void cb_lev_read_socket(struct bufferevent *bev, void *ctx) {
+    struct worker_t *w = ((struct conn_state_t*) ctx)->worker;
+    uint64_t start_ns = callback_start_ns();
+    lev_read_socket(bev, ctx);
+    stats_record_callback(w, CB_LEV_READ_SOCKET, start_ns);
+}
+
+struct evbuffer *bev_output(struct conn_state_t *state) {
+    return bufferevent_get_output(state->bev);
+}
+
+void bev_drain(struct conn_state_t *state) {
+    bufferevent_disable(state->bev, EV_READ);
+    if (evbuffer_get_length(bufferevent_get_output(state->bev)) == 0) {
+        close_conn(state, NULL);
+        return;
+    }
+    // Have the write callback run once the output is empty
+    bufferevent_setcb(state->bev, NULL, cb_lev_write_socket, cb_lev_event, state);
+    bufferevent_setwatermark(state->bev, EV_WRITE, 0, 0);
+}
+
+// The bufferevent owns the socket (and with TLS, the SSL object) and frees it
+void bev_free(struct conn_state_t *state) {
+    if (ssl_ctx && !state->handshake_done) {
+        stat_add(&state->worker->stats.tls_failed, 1);
+    }
+    bufferevent_free(state->bev);
+}
+
+const struct transport_t BEV_TRANSPORT = {
+    .kind = LISTENER_LEV,
+    .output = bev_output,
+    .drain = bev_drain,
+    .free = bev_free,
+};
+
+// Set up a :7777 connection once it has been accepted, here or on the
+// acceptor thread
+void lev_conn_setup(struct worker_t *w, evutil_socket_t fd, struct sockaddr *addr,
+                    socklen_t socklen) {
+    struct conn_state_t *state = alloc_conn_state(w);
+    if (state == NULL) {
+        evutil_closesocket(fd);
+        return;
+    }
+    state->fd = fd;
+    memcpy(&state->peer, addr, socklen);
+    set_tcp_conn_options(fd, addr);
+    format_address(addr, state->addr, sizeof(state->addr), &state->port);
+
+    // The evconnlistener has already accepted this one, so all that can be
+    // done over the cap is to close it and stop accepting more
+    int admitted = admit_conn(state);
+    if (admitted == 0) {
+        admitted = admit_peer(state, addr);
+    }
+    if (admitted < 0) {
+        log_msg(LOG_DEBUG, "Rejecting %s:%d, %s\n", state->addr, state->port,
+                admitted == IP_TABLE_FULL ? "the address table is full"
+                                          : "too many connections");
+        stat_add(&w->stats.listeners[LISTENER_LEV].rejected, 1);
+        evutil_closesocket(fd);
+        free_conn_state(state);
+        return;
+    }
+
+    state->accepted_ns = now_ns();
+    state->balance_ns = state->accepted_ns;
+    if (ssl_ctx) {
+        // The handshake runs on this worker, inside the bufferevent. Since
+        // every worker has its own SO_REUSEPORT listener, the handshakes are
+        // spread over all of the threads.
+        SSL *ssl = SSL_new(ssl_ctx);
+        if (ssl == NULL) {
+            log_msg(LOG_INFO, "Failed to create SSL object\n");
+            evutil_closesocket(fd);
+            free_conn_state(state);
+            return;
+        }
+        state->bev = bufferevent_openssl_socket_new(w->base, fd, ssl, BUFFEREVENT_SSL_ACCEPTING,
+                                                    BEV_OPT_CLOSE_ON_FREE | config.lev_bev_options);
+        if (state->bev == NULL) {
+            SSL_free(ssl);
+        } else {
+            // Treat a peer closing without close_notify as a plain EOF
+            bufferevent_openssl_set_allow_dirty_shutdown(state->bev, 1);
+        }
+    } else {
+        state->bev = bufferevent_socket_new(w->base, fd,
+                                            BEV_OPT_CLOSE_ON_FREE | config.lev_bev_options);
+    }
+    if (state->bev == NULL) {
+        perror("Failed to create bufferevent\n");
+        evutil_closesocket(fd);
+        free_conn_state(state);
+        return;
+    }
+    state->transport = &BEV_TRANSPORT;
+
+    // Let the bufferevent read as much per callback as the raw path does.
+    // Note that libevent 2.1 still caps a single read at 4 KiB internally.
+    bufferevent_set_max_single_read(state->bev, config.read_buf_size);
+    bufferevent_priority_set(state->bev, config.lev_priority);
+    struct ev_token_bucket_cfg *rate_cfg = __atomic_load_n(&conn_rate_cfg, __ATOMIC_ACQUIRE);
+    if (rate_cfg) {
+        bufferevent_set_rate_limit(state->bev, rate_cfg);
+    }
+    if (w->rate_group) {
+        bufferevent_add_to_rate_limit_group(state->bev, w->rate_group);
+    }
+    bufferevent_setcb(state->bev, cb_lev_read_socket,
+                      config.echo ? cb_lev_write_socket : NULL, cb_lev_event, state);
+    if (evbuffer_add_cb(bufferevent_get_input(state->bev), lev_input_added, state->bev) == NULL) {
+        perror("Failed to add input buffer callback\n");
+        bufferevent_free(state->bev);
+        free_conn_state(state);
+        return;
+    }
+    stat_add(&w->stats.listeners[LISTENER_LEV].accepted, 1);
+    TRACE3(accept, w->id, fd, LISTENER_LEV);
+    if (w->event_ring) {
+        event_log_accept(state);
+    }
+    const struct conn_limits_t *limits = get_conn_limits();
+    bufferevent_setwatermark(state->bev, EV_WRITE, limits->write_low_wm, limits->write_high_wm);
+    bufferevent_set_timeouts(state->bev, w->idle_timeout, w->idle_timeout);
+    conn_start_idle_timer(state);
+    handler->on_accept(state);
+    bufferevent_setwatermark(state->bev, EV_READ, state->read_low_wm, 0);
+    bufferevent_enable(state->bev, EV_READ);
+}
+
+void lev_accept(struct evconnlistener *listener, evutil_socket_t fd,
+                struct sockaddr* addr, int socklen, void *ctx) {
+    lev_conn_setup(ctx, fd, addr, socklen);
+}
+
+void cb_lev_accept(struct evconnlistener *listener, evutil_socket_t fd,
+                   struct sockaddr* addr, int socklen, void *ctx) {
+    uint64_t start_ns = callback_start_ns();
+    lev_accept(listener, fd, addr, socklen, ctx);
+    stats_record_callback(ctx, CB_LEV_ACCEPT, start_ns);
+}
+
+struct lev_conn_msg_t {
+    struct worker_msg_t msg;
+    evutil_socket_t fd;
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+};
+
+// Runs on the worker. Once it's draining, connections still on the way are
+// closed, which is also how free_worker cleans up any that never got run.
+void handle_lev_conn(struct worker_t *w, struct worker_msg_t *msg) {
+    struct lev_conn_msg_t *m = (struct lev_conn_msg_t*) msg;
+    uint64_t start_ns = callback_start_ns();
+
+    if (w->draining) {
+        evutil_closesocket(m->fd);
+    } else {
+        lev_conn_setup(w, m->fd, (struct sockaddr*) &m->peer, m->peer_len);
+        stats_record_callback(w, CB_LEV_ACCEPT, start_ns);
+    }
+    free(m);
+}
+
+void cb_acceptor_accept(struct evconnlistener *listener, evutil_socket_t fd,
+                        struct sockaddr* addr, int socklen, void *ctx) {
+    struct lev_conn_msg_t *m = malloc(sizeof(struct lev_conn_msg_t));
+    if (m == NULL) {
+        perror("Failed to malloc lev_conn_msg_t\n");
+        evutil_closesocket(fd);
+        return;
+    }
+    m->msg.handle = handle_lev_conn;
+    m->fd = fd;
+    memcpy(&m->peer, addr, socklen);
+    m->peer_len = socklen;
+
+    worker_post(&workers[acceptor->next_worker], &m->msg);
+    acceptor->next_worker = (acceptor->next_worker + 1) % config.num_threads;
+}
+
+// Connection migration. With --rebalance, cb_timer compares how much each
+// worker read since it last ran, and when the busiest one is well ahead of the
+// average it asks that worker to move some connections to the idlest one. The
+// busy worker picks the biggest readers that narrow the difference,
+// stops their events and sends each one over in a message with a copy of its
+// state, which the other worker takes into its own pool and re-attaches to its
+// own base. The socket, evbuffers, bufferevent and admission counts move with
+// it.
+#define REBALANCE_SKEW_PCT 25
+#define REBALANCE_MIN_RATE (1024 * 1024)    // bytes/s the busiest worker has to read
+#define REBALANCE_MAX_CONNS 16              // moved per run
+#define REBALANCE_MIN_AGE_MS 1000           // before a connection's rate means anything
+
+struct rebalance_msg_t {
+    struct worker_msg_t msg;
+    int to;
+    double gap;     // how many bytes/s more the busiest worker read
+};
+
+struct conn_migrate_msg_t {
+    struct worker_msg_t msg;
+    short bev_enabled;
+    struct conn_state_t state;
+};
+
+// Only connections that nothing on this worker still points into can move. On
+// :8888 big reads are attached by reference to buffers from the worker's read
+// pool, so no input or output may be left over, and it mustn't be paused or
+// waiting for tokens. On :7777 bufferevent_base_set() only works for plain
+// socket bufferevents, and a deferred callback could still be queued on the
+// old base.
+int conn_can_migrate(struct conn_state_t *state) {
+    if (state->transport == &RAW_TRANSPORT) {
+        return !state->reading_paused && !state->throttled &&
+               evbuffer_get_length(state->input) == 0 &&
+               (state->output == NULL || evbuffer_get_length(state->output) == 0);
+    }
+    return !ssl_ctx && !(config.lev_bev_options & BEV_OPT_DEFER_CALLBACKS);
+}
+
+// Runs on the worker the connection moves to, which may be draining, or even
+// freeing itself at shutdown. Its drain may have finished already, so nothing
+// would flush the connection's output, and it's closed right away instead.
+void handle_conn_migrate(struct worker_t *w, struct worker_msg_t *msg) {
+    struct conn_migrate_msg_t *m = (struct conn_migrate_msg_t*) msg;
+
+    struct conn_state_t *state = alloc_conn_state(w);
+    if (state == NULL) {
+        if (m->state.bev) {
+            bufferevent_base_set(w->base, m->state.bev);
+            bufferevent_free(m->state.bev);
+        } else {
+            evbuffer_free(m->state.input);
+            if (m->state.output) {
+                evbuffer_free(m->state.output);
+            }
+            evutil_closesocket(m->state.fd);
+        }
+        m->state.worker = w;
+        release_admission(&m->state);
+        free(m);
+        return;
+    }
+
+    // Everything but the slot's own bookkeeping comes from the old worker
+    struct conn_state_t *prev = state->prev;
+    struct conn_state_t *next = state->next;
+    uint16_t uring_gen = state->uring_gen;
+    *state = m->state;
+    state->worker = w;
+    state->prev = prev;
+    state->next = next;
+    state->uring_gen = uring_gen;
+    state->balance_bytes = 0;
+    state->balance_ns = now_ns();
+    stat_add(&w->stats.listeners[state->transport->kind].migrated_in, 1);
+
+    if (w->draining) {
+        if (state->bev) {
+            bufferevent_base_set(w->base, state->bev);
+        } else {
+            raw_assign_events(state);
+        }
+        close_conn(state, NULL);
+        free(m);
+        return;
+    }
+    conn_start_idle_timer(state);
+
+    if (state->bev) {
+        if (bufferevent_base_set(w->base, state->bev) < 0) {
+            perror("Failed to move bufferevent\n");
+            close_conn(state, NULL);
+            free(m);
+            return;
+        }
+        // Setting the base resets the priority
+        bufferevent_priority_set(state->bev, config.lev_priority);
+        bufferevent_setcb(state->bev, cb_lev_read_socket,
+                          config.echo ? cb_lev_write_socket : NULL, cb_lev_event, state);
+        bufferevent_set_timeouts(state->bev, w->idle_timeout, w->idle_timeout);
+        bufferevent_enable(state->bev, m->bev_enabled);
+    } else {
+        raw_assign_events(state);
+        if (raw_start_reading(state)) {
+            perror("Failed to add read socket event\n");
+            close_conn(state, NULL);
+            free(m);
+            return;
+        }
+    }
+    free(m);
+}
+
+// Detach a connection from its worker and send it to another one
+int conn_migrate(struct conn_state_t *state, struct worker_t *to) {
+    struct worker_t *w = state->worker;
+    struct conn_migrate_msg_t *m = malloc(sizeof(struct conn_migrate_msg_t));
+    if (m == NULL) {
+        perror("Failed to malloc conn_migrate_msg_t\n");
+        return -1;
+    }
+    m->msg.handle = handle_conn_migrate;
+
+    if (state->bev) {
+        m->bev_enabled = bufferevent_get_enabled(state->bev);
+        bufferevent_disable(state->bev, EV_READ | EV_WRITE);
+    } else {
+        raw_stop_reading(state);
+        if (state->output) {
+            event_del(&state->event_write_socket);
+        }
+    }
+    wheel_remove(w, state);
+    log_msg(LOG_DEBUG, "Moving %s:%d to worker %d\n", state->addr, state->port, to->id);
+    TRACE3(migrate, w->id, state->fd, to->id);
+    stat_add(&w->stats.listeners[state->transport->kind].migrated_out, 1);
+
+    m->state = *state;
+    put_conn_state(state);
+    worker_post(to, &m->msg);
+    return 0;
+}
+
+// Runs on the busiest worker. Moving a connection that reads r bytes/s
+// narrows the gap by 2r, so each round moves the fastest reader below the gap
+// that's left. One heavy connection then doesn't just make the other worker
+// the busiest.
+void handle_rebalance(struct worker_t *w, struct worker_msg_t *msg) {
+    struct rebalance_msg_t *m = (struct rebalance_msg_t*) msg;
+    uint64_t now = now_ns();
+    double gap = m->gap;
+
+    for (int moved = 0; moved < REBALANCE_MAX_CONNS && gap > 0 && !w->draining; ++moved) {
+        struct conn_state_t *best = NULL;
+        double best_rate = 0;
+        for (struct conn_state_t *state = w->conn_pool.active; state; state = state->next) {
+            uint64_t age_ns = now - state->balance_ns;
+            if (age_ns < REBALANCE_MIN_AGE_MS * 1000000ull || !conn_can_migrate(state)) {
+                continue;
+            }
+            double rate = state->balance_bytes * 1e9 / age_ns;
+            if (rate > best_rate && rate < gap) {
+                best = state;
+                best_rate = rate;
+            }
+        }
+        if (best == NULL || conn_migrate(best, &workers[m->to]) < 0) {
+            break;
+        }
+        gap -= 2 * best_rate;
+    }
+    free(m);
+}
+
+// Runs on the main thread from cb_timer, every secs seconds
+// What each worker has read so far, over both listeners
+uint64_t worker_bytes_read(struct worker_t *w) {
+    uint64_t bytes = 0;
+    for (int l = 0; l < NUM_LISTENERS; ++l) {
+        bytes += stat_load(&w->stats.listeners[l].bytes_read);
+    }
+    return bytes;
+}
+
+// Start measuring again from now, for when the time between runs changes
+void rebalance_reset() {
+    for (int i = 0; i < config.num_threads; ++i) {
+        workers[i].balancer_bytes = worker_bytes_read(&workers[i]);
+        workers[i].balancer_load = 0;
+    }
+}
+
+void rebalance(long secs) {
+    struct worker_t *busiest = NULL;
+    struct worker_t *idlest = NULL;
+    uint64_t total = 0;
+
+    for (int i = 0; i < config.num_threads; ++i) {
+        struct worker_t *w = &workers[i];
+        uint64_t bytes = worker_bytes_read(w);
+        w->balancer_load = bytes - w->balancer_bytes;
+        w->balancer_bytes = bytes;
+        total += w->balancer_load;
+
+        if (busiest == NULL || w->balancer_load > busiest->balancer_load) {
+            busiest = w;
+        }
+        if (idlest == NULL || w->balancer_load < idlest->balancer_load) {
+            idlest = w;
+        }
+    }
+
+    uint64_t average = total / config.num_threads;
+    if (busiest->balancer_load < (uint64_t) REBALANCE_MIN_RATE * secs ||
+        busiest->balancer_load * 100 <= average * (100 + REBALANCE_SKEW_PCT)) {
+        return;
+    }
+
+    struct rebalance_msg_t *m = malloc(sizeof(struct rebalance_msg_t));
+    if (m == NULL) {
+        perror("Failed to malloc rebalance_msg_t\n");
+        return;
+    }
+    m->msg.handle = handle_rebalance;
+    m->to = idlest->id;
+    m->gap = (double) (busiest->balancer_load - idlest->balancer_load) / secs;
+    log_msg(LOG_INFO, "Rebalancing: worker %d read %.1f KiB/s, worker %d %.1f KiB/s\n",
+            busiest->id, (double) busiest->balancer_load / secs / 1024,
+            idlest->id, (double) idlest->balancer_load / secs / 1024);
+    worker_post(busiest, &m->msg);
+}
+
+void cb_timer(evutil_socket_t fd, short what, void *arg) {
+    struct timeval *tv = arg;
+    static struct stats_summary_t prev;
+
+    struct stats_summary_t cur;
+    stats_summarize(&cur);
+
+    log_msg(LOG_INFO, "Timer fired after %ld seconds! %lu active connections, "
+            "%.1f reads/s, %.1f KiB/s read\n", tv->tv_sec, cur.active,
+            (double) (cur.reads - prev.reads) / tv->tv_sec,
+            (double) (cur.bytes_read - prev.bytes_read) / tv->tv_sec / 1024);
+    if (ssl_ctx) {
+        uint64_t handshakes = cur.tls_handshakes - prev.tls_handshakes;
+        uint64_t resumed = cur.tls_resumed - prev.tls_resumed;
+        log_msg(LOG_INFO, "%.1f TLS handshakes/s, %.1f%% resumed\n",
+                (double) handshakes / tv->tv_sec,
+                handshakes ? 100.0 * resumed / handshakes : 0.0);
+    }
+    prev = cur;
+
+    if (config.rebalance && config.num_threads > 1) {
+        rebalance(tv->tv_sec);
+    }
+}
+
+// Close whatever is left and let the worker's loop finish
+void drain_finish(struct worker_t *w) {
+    struct conn_pool_t *pool = &w->conn_pool;
+
+    if (pool->num_active > 0) {
+        log_msg(LOG_INFO, "Worker %d closing %zu connection(s) that didn't drain\n",
+                w->id, pool->num_active);
+    }
+    while (pool->active) {
+        close_conn(pool->active, NULL);
+    }
+
+    event_del(w->event_grace);
+    event_del(w->event_tick);
+    if (w->event_rate) {
+        event_del(w->event_rate);
+    }
+    event_base_loopexit(w->base, NULL);
+}
+
+void cb_grace(evutil_socket_t fd, short what, void *arg) {
+    drain_finish(arg);
+}
+
+void cb_drain(evutil_socket_t fd, short what, void *arg) {
+    struct worker_t *w = arg;
+    struct conn_pool_t *pool = &w->conn_pool;
+
+    // A second signal cuts the grace period short
+    if (w->draining) {
+        drain_finish(w);
+        return;
+    }
+    w->draining = 1;
+
+    // Stop accepting. Connections still in the kernel's accept queues get
+    // reset when the listeners are closed at exit.
+    set_accepting(w, 0);
+
+    struct conn_state_t *state = pool->active;
+    while (state) {
+        struct conn_state_t *next = state->next;
+        state->transport->drain(state);
+        state = next;
+    }
+
+    if (pool->num_active == 0 || config.grace_period_s == 0) {
+        drain_finish(w);
+        return;
+    }
+    log_msg(LOG_INFO, "Worker %d waiting for %zu connection(s) to drain\n",
+            w->id, pool->num_active);
+    struct timeval grace_tv = {config.grace_period_s, 0};
+    event_add(w->event_grace, &grace_tv);
+}
+
+void close_worker_listeners(struct worker_t *w) {
+    for (int i = 0; i < w->num_listeners; ++i) {
+        event_free(w->event_listeners[i]);
+        evutil_closesocket(w->listeners[i]);
+    }
+    for (int i = 0; i < w->num_lev_listeners; ++i) {
+        evconnlistener_free(w->lev_listeners[i]);
+    }
+    w->num_listeners = 0;
+    w->num_lev_listeners = 0;
+}
+
+void unlink_unix_listeners(const struct listen_addr_t *addrs, int num) {
+    for (int i = 0; i < num; ++i) {
+        if (addrs[i].ss.ss_family == AF_UNIX) {
+            unlink(((const struct sockaddr_un*) &addrs[i].ss)->sun_path);
+        }
+    }
+}
+
+// Free everything a worker owns. Its loop must have finished.
+void free_worker(struct worker_t *w) {
+    struct worker_msg_t *msg;
+    while ((msg = msg_queue_pop(&w->msgs)) != NULL) {
+        msg->handle(w, msg);
+    }
+    event_free(w->event_msgs);
+    event_free(w->event_drain);
+    event_free(w->event_grace);
+    event_free(w->event_tick);
+    if (w->event_rate) {
+        event_free(w->event_rate);
+    }
+    close_worker_listeners(w);
+    if (w->id == 0) {
+        unlink_unix_listeners(config.raw_addrs, config.num_raw_addrs);
+        unlink_unix_listeners(config.lev_addrs, config.num_lev_addrs);
+    }
+    if (w->rate_group) {
+        bufferevent_rate_limit_group_free(w->rate_group);
+    }
+    if (w->uring) {
+        uring_free(w->uring);
+    }
+    conn_pool_destroy(&w->conn_pool);
+    read_pool_destroy(&w->read_pool);
+    event_base_free(w->base);
+}
+
+SSL_CTX *new_ssl_ctx() {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL) {
+        fprintf(stderr, "Failed to create SSL context\n");
+        return NULL;
+    }
+    if (SSL_CTX_use_certificate_chain_file(ctx, config.tls_cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, config.tls_key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        fprintf(stderr, "Failed to load TLS certificate or key: %s\n",
+                ERR_reason_error_string(ERR_get_error()));
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    // Resumption: TLS 1.2 clients can use either the session cache or a
+    // ticket, TLS 1.3 clients get tickets. The session id context must be set
+    // for cached sessions to be accepted at all.
+    static const unsigned char sid_ctx[] = "libevent-learn";
+    SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, config.tls_cache_size);
+    SSL_CTX_set_timeout(ctx, 300);
+
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // Since OpenSSL 3.0 a peer closing without close_notify is an error
+    // unless asked otherwise, which libevent 2.1 doesn't know to look for
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+    // Partial writes and moving buffers fit how bufferevents write
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                     SSL_MODE_RELEASE_BUFFERS);
+    return ctx;
+}
+
+struct reload_msg_t {
+    struct worker_msg_t msg;
+    struct reload_t *reload;
+};
+
+// What a reload changed, with the messages that tell each worker. The last
+// one to handle its message frees it, along with the token bucket settings
+// the connections were using before.
+struct reload_t {
+    int refs;
+    int idle_timeout_changed;
+    int rate_limit_changed;
+    int listeners_changed;
+    int max_conns_raised;
+    struct ev_token_bucket_cfg *old_conn_rate_cfg;
+    struct conn_limits_t *old_conn_limits;
+
+    // Unix domain sockets that stay are bound again, the others removed
+    struct listen_addr_t old_raw_addrs[MAX_LISTEN_ADDRS];
+    int num_old_raw_addrs;
+    struct listen_addr_t old_lev_addrs[MAX_LISTEN_ADDRS];
+    int num_old_lev_addrs;
+
+    struct reload_msg_t msgs[];
+};
+
+int has_addr(const struct listen_addr_t *addrs, int num, const struct listen_addr_t *la) {
+    for (int i = 0; i < num; ++i) {
+        if (addrs[i].len == la->len && memcmp(&addrs[i].ss, &la->ss, la->len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A Unix domain socket outlives the process that bound it. One left behind
+// by an earlier run is removed, once nothing answers on it any more. A live
+// one, or anything that isn't a socket, is left alone and the bind fails.
+// With replace it's this process's own, which a swap binds again.
+int remove_stale_unix_socket(const struct listen_addr_t *la, int replace) {
+    const char *path = ((const struct sockaddr_un*) &la->ss)->sun_path;
+    struct stat st;
+
+    if (lstat(path, &st) < 0 || !S_ISSOCK(st.st_mode)) {
+        return 0;
+    }
+    if (!replace) {
+        // Nonblocking, so a full accept queue counts as live rather than
+        // holding this up
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            perror("Failed to create socket\n");
+            return -1;
+        }
+        int refused = connect(fd, (const struct sockaddr*) &la->ss, la->len) < 0 &&
+                      errno == ECONNREFUSED;
+        close(fd);
+        if (!refused) {
+            return 0;
+        }
+    }
+    if (unlink(path) < 0) {
+        fprintf(stderr, "Failed to remove %s: %s\n", la->text, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Create a listening socket for one address. TCP ones get SO_REUSEPORT so
+// every worker can bind its own. A stale Unix domain socket left behind by an
+// earlier run is removed first, and with replace this process's own too.
+// With a cpu, the kernel prefers this socket
+// over the others bound to the port for connections whose packets are
+// processed on that CPU (SO_INCOMING_CPU). That only steers anything when the
+// NIC's receive queue interrupts are spread over the same CPUs.
+evutil_socket_t open_listener(const struct listen_addr_t *la, int backlog_sz, int cpu,
+                              int replace) {
+    int family = la->ss.ss_family;
+    evutil_socket_t listener = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener == -1) {
+        perror("Failed to create listener socket\n");
+        return -1;
+    }
+
+    int enabled = 1;
+    if (family == AF_UNIX) {
+        if (remove_stale_unix_socket(la, replace) < 0) {
+            goto fail;
+        }
+    } else {
+        if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)) < 0) {
+            perror("Failed to set SO_REUSEADDR socket option\n");
+            goto fail;
+        }
+        // Every worker binds its own socket to the same port
+        if (setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &enabled, sizeof(enabled)) < 0) {
+            perror("Failed to set SO_REUSEPORT socket option\n");
+            goto fail;
+        }
+        if (set_tcp_listener_options(listener) < 0) {
+            goto fail;
+        }
+        if (cpu >= 0 &&
+            set_int_option(listener, SOL_SOCKET, SO_INCOMING_CPU, cpu, "SO_INCOMING_CPU") < 0) {
+            goto fail;
+        }
+    }
+    // An IPv6 wildcard takes IPv4 connections too, unless IPv4 has its own
+    // listener on the same port
+    if (family == AF_INET6 &&
+        setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &la->v6only, sizeof(la->v6only)) < 0) {
+        perror("Failed to set IPV6_V6ONLY socket option\n");
+        goto fail;
+    }
+
+    if (bind(listener, (struct sockaddr*) &la->ss, la->len) < 0) {
+        fprintf(stderr, "Failed to bind %s: %s\n", la->text, strerror(errno));
+        goto fail;
+    }
+
+    if (listen(listener, backlog_sz) < 0) {
+        perror("Failed to listen on listener\n");
+        goto fail;
+    }
+
+    return listener;
+
+fail:
+    evutil_closesocket(listener);
+    return -1;
+}
+
+struct event_base *new_event_base() {
+    struct event_config *cfg = event_config_new();
+    if (cfg == NULL) {
+        perror("Failed to create event config\n");
+        return NULL;
+    }
+
+    // libevent can only be told which methods not to use, so requiring one
+    // means avoiding all of the others
+    if (config.backend) {
+        const char **methods = event_get_supported_methods();
+        for (int i = 0; methods[i] != NULL; ++i) {
+            if (strcmp(methods[i], config.backend) != 0) {
+                event_config_avoid_method(cfg, methods[i]);
+            }
+        }
+    }
+    for (int i = 0; i < config.num_avoid_backends; ++i) {
+        event_config_avoid_method(cfg, config.avoid_backends[i]);
+    }
+    event_config_set_flag(cfg, config.base_flags);
+
+    // Control events have the most urgent priority and are never held back
+    if (config.max_dispatch_us || config.max_dispatch_callbacks) {
+        struct timeval max_tv = {config.max_dispatch_us / 1000000, config.max_dispatch_us % 1000000};
+        if (event_config_set_max_dispatch_interval(
+                cfg, config.max_dispatch_us ? &max_tv : NULL,
+                config.max_dispatch_callbacks ? config.max_dispatch_callbacks : -1,
+                PRIO_DEFAULT)) {
+            perror("Failed to set max dispatch interval\n");
+            event_config_free(cfg);
+            return NULL;
+        }
+    }
+
+    struct event_base *base = event_base_new_with_config(cfg);
+    event_config_free(cfg);
+
+    if (base && config.backend && strcmp(event_base_get_method(base), config.backend) != 0) {
+        fprintf(stderr, "Event backend %s is not available\n", config.backend);
+        event_base_free(base);
+        return NULL;
+    }
+    return base;
+}
+
+void log_event_base(struct event_base *base) {
+    int features = event_base_get_features(base);
+
+    log_msg(LOG_INFO, "Using libevent %s with the %s backend (features:%s%s%s%s)%s%s\n",
+            event_get_version(), event_base_get_method(base),
+            features & EV_FEATURE_ET ? " edge-triggered" : "",
+            features & EV_FEATURE_O1 ? " O(1)" : "",
+            features & EV_FEATURE_FDS ? " any-fd" : "",
+            features & EV_FEATURE_EARLY_CLOSE ? " early-close" : "",
+            config.base_flags & EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST ? ", epoll changelist" : "",
+            config.base_flags & EVENT_BASE_FLAG_PRECISE_TIMER ? ", precise timer" : "");
+}
+
+// Restrict a thread to one CPU, or with cpu -1, to the CPUs in cpus
+int pin_thread(pthread_t thread, int cpu, const cpu_set_t *cpus) {
+    cpu_set_t set;
+    if (cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        cpus = &set;
+    }
+    int err = pthread_setaffinity_np(thread, sizeof(cpu_set_t), cpus);
+    if (err) {
+        fprintf(stderr, "Failed to pin thread to CPU %d: %s\n", cpu, strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+// Open this worker's listeners on the addresses in config, accepting
+// r is the reload that's swapping the listeners, if any. Its old Unix domain
+// sockets are still bound and get replaced.
+int open_worker_listeners(struct worker_t *w, const struct reload_t *r) {
+    int incoming_cpu = config.incoming_cpu ? w->cpu : -1;
+
+    // Add events that listen on the raw sockets, or accept on them through
+    // io_uring
+    for (int i = 0; i < config.num_raw_addrs; ++i) {
+        const struct listen_addr_t *la = &config.raw_addrs[i];
+        if (la->ss.ss_family == AF_UNIX && w->id != 0) {
+            continue;
+        }
+
+        int replace = r && (has_addr(r->old_raw_addrs, r->num_old_raw_addrs, la) ||
+                            has_addr(r->old_lev_addrs, r->num_old_lev_addrs, la));
+        evutil_socket_t listener = open_listener(la, config.backlog, incoming_cpu, replace);
+        if (listener < 0) {
+            return -1;
+        }
+        struct event *event_listener = event_new(w->base, listener, EV_READ | EV_PERSIST,
+                                                 cb_accept_conn, (void *)w);
+        w->listeners[w->num_listeners] = listener;
+        w->event_listeners[w->num_listeners++] = event_listener;
+
+        event_priority_set(event_listener, PRIO_CONTROL);
+        if (w->uring) {
+            uring_start_accept(w, w->num_listeners - 1);
+        } else if (event_add(event_listener, NULL)) {
+            perror("Failed to add socket listener event\n");
+            return -1;
+        }
+    }
+
+    // And evconnlisteners on the others, unless the acceptor thread has them.
+    // The sockets are set up here, so the evconnlistener doesn't call listen()
+    // again.
+    for (int i = 0; i < config.num_lev_addrs && !config.acceptor_thread; ++i) {
+        const struct listen_addr_t *la = &config.lev_addrs[i];
+        if (la->ss.ss_family == AF_UNIX && w->id != 0) {
+            continue;
+        }
+
+        int replace = r && (has_addr(r->old_raw_addrs, r->num_old_raw_addrs, la) ||
+                            has_addr(r->old_lev_addrs, r->num_old_lev_addrs, la));
+        evutil_socket_t listener = open_listener(la, config.backlog, incoming_cpu, replace);
+        if (listener < 0) {
+            return -1;
+        }
+        struct evconnlistener *lev_listener = evconnlistener_new(
+            w->base, cb_lev_accept, (void *)w, LEV_OPT_CLOSE_ON_FREE, 0, listener);
+        if (!lev_listener) {
+            perror("Failed to create lev listener\n");
+            evutil_closesocket(listener);
+            return -1;
+        }
+        w->lev_listeners[w->num_lev_listeners++] = lev_listener;
+    }
+
+    return 0;
+}
+
+int setup_worker(struct worker_t *w) {
+    if (config.event_log) {
+        if (posix_memalign((void**) &w->event_ring, 64, sizeof(struct event_ring_t))) {
+            perror("Failed to allocate event log ring\n");
+            return -1;
+        }
+        memset(w->event_ring, 0, sizeof(struct event_ring_t));
+    }
+
+    w->base = new_event_base();
+    if (!w->base) {
+        perror("Failed to create event base\n");
+        return -1;
+    }
+    if (event_base_priority_init(w->base, NUM_PRIORITIES)) {
+        perror("Failed to init event priorities\n");
+        return -1;
+    }
+
+    if (config.timer_wheel) {
+        w->wheel_tick = now_ns() / (WHEEL_TICK_MS * 1000000ull);
+    } else if (config.idle_timeout_s > 0) {
+        w->idle_tv.tv_sec = config.idle_timeout_s;
+        w->idle_timeout = event_base_init_common_timeout(w->base, &w->idle_tv);
+        if (w->idle_timeout == NULL) {
+            perror("Failed to init idle timeout\n");
+            return -1;
+        }
+    }
+
+    struct timeval tick_tv = {0, LOG_FLUSH_INTERVAL_MS * 1000};
+    w->event_tick = event_new(w->base, -1, EV_PERSIST, cb_worker_tick, (void *)w);
+    event_priority_set(w->event_tick, PRIO_CONTROL);
+    if (event_add(w->event_tick, &tick_tv)) {
+        perror("Failed to add tick event\n");
+        return -1;
+    }
+
+    if (config.rate_limit || config.global_rate_limit) {
+        struct timeval rate_tv = {0, RATE_TICK_MS * 1000};
+        w->event_rate = event_new(w->base, -1, EV_PERSIST, cb_rate_tick, (void *)w);
+        event_priority_set(w->event_rate, PRIO_CONTROL);
+        if (event_add(w->event_rate, &rate_tv)) {
+            perror("Failed to add rate limit event\n");
+            return -1;
+        }
+    }
+    if (group_rate_cfg) {
+        w->rate_group = bufferevent_rate_limit_group_new(w->base, group_rate_cfg);
+        if (w->rate_group == NULL) {
+            perror("Failed to create rate limit group\n");
+            return -1;
+        }
+    }
 
-#include "event2/buffer.h"
-#include "event2/bufferevent.h"
-#include "event2/event.h"
-#include "event2/listener.h"
+    msg_queue_init(&w->msgs);
+    w->event_msgs = event_new(w->base, -1, 0, cb_worker_msgs, (void *)w);
+    if (!w->event_msgs) {
+        perror("Failed to create message event\n");
+        return -1;
+    }
+    event_priority_set(w->event_msgs, PRIO_CONTROL);
 
-struct timeval TIMEOUT_S = {30, 0};
+    w->event_drain = event_new(w->base, -1, 0, cb_drain, (void *)w);
+    w->event_grace = evtimer_new(w->base, cb_grace, (void *)w);
+    if (!w->event_drain || !w->event_grace) {
+        perror("Failed to create drain events\n");
+        return -1;
+    }
+    event_priority_set(w->event_drain, PRIO_CONTROL);
+    event_priority_set(w->event_grace, PRIO_CONTROL);
 
-struct conn_state_t {
-    struct sockaddr_in sin;
-    struct event* event_read_socket;
+    if (config.io_uring) {
+        w->uring = uring_new(w);
+    }
+
+    return open_worker_listeners(w, NULL);
+}
+
+// Set while workers are still applying a reload, so the next one has to wait
+int reload_busy;
+
+// Move a connection's idle timeout and rate limit over to the new settings
+void reload_conn(struct conn_state_t *state, const struct reload_t *r) {
+    struct worker_t *w = state->worker;
+
+    if (state->bev) {
+        if (r->idle_timeout_changed) {
+            bufferevent_set_timeouts(state->bev, w->idle_timeout, w->idle_timeout);
+        }
+        if (r->rate_limit_changed && conn_rate_cfg) {
+            bufferevent_set_rate_limit(state->bev, conn_rate_cfg);
+        }
+        return;
+    }
+    // Adding a pending event again restarts its timeout with the new one
+    if (r->idle_timeout_changed &&
+        event_pending(&state->event_read_socket, EV_READ | EV_TIMEOUT, NULL)) {
+        event_add(&state->event_read_socket, w->idle_timeout);
+    }
+    if (r->idle_timeout_changed && state->output &&
+        event_pending(&state->event_write_socket, EV_WRITE, NULL)) {
+        event_add(&state->event_write_socket, w->idle_timeout);
+    }
+}
+
+// Take what's still queued on a listener that's being replaced. The kernel
+// resets connections left in the accept queue of a SO_REUSEPORT socket when
+// it's closed, unless net.ipv4.tcp_migrate_req is set, and handshakes that
+// finish between this and the close still get lost without it.
+// Unlike accept_conn, there's no queue left to leave connections over the cap
+// in, so those are closed, and it carries on until the queue is empty.
+void drain_raw_listener(struct worker_t *w, evutil_socket_t listener) {
+    for (;;) {
+        struct conn_state_t *state = alloc_conn_state(w);
+        if (state == NULL) {
+            return;
+        }
+        socklen_t slen = sizeof(state->peer);
+        int fd = accept4(listener, (struct sockaddr*) &state->peer, &slen,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            free_conn_state(state);
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return; // empty, or accept() failed
+        }
+        if (admit_conn(state) < 0) {
+            stat_add(&w->stats.listeners[LISTENER_RAW].rejected, 1);
+            close(fd);
+            free_conn_state(state);
+            continue;
+        }
+        state->fd = fd;
+        raw_conn_setup(state);
+    }
+}
+
+void drain_lev_listener(struct worker_t *w, struct evconnlistener *lev_listener) {
+    evutil_socket_t listener = evconnlistener_get_fd(lev_listener);
+    struct sockaddr_storage peer;
+    socklen_t slen = sizeof(peer);
+    int fd;
+
+    evconnlistener_disable(lev_listener);
+    while ((fd = accept4(listener, (struct sockaddr*) &peer, &slen,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        lev_conn_setup(w, fd, (struct sockaddr*) &peer, slen);
+        slen = sizeof(peer);
+    }
+}
+
+// Unix domain sockets don't go away by themselves, but one that's still in
+// the config has been bound again by now
+void unlink_old_unix_listeners(const struct listen_addr_t *old, int num_old,
+                               const struct listen_addr_t *addrs, int num) {
+    for (int i = 0; i < num_old; ++i) {
+        if (old[i].ss.ss_family == AF_UNIX && !has_addr(addrs, num, &old[i])) {
+            unlink(((const struct sockaddr_un*) &old[i].ss)->sun_path);
+        }
+    }
+}
+
+// The new listeners are open before the old ones close, so there's always
+// one bound to each port that stays
+void swap_listeners(struct worker_t *w, const struct reload_t *r) {
+    int num_old = w->num_listeners;
+    int num_old_lev = w->num_lev_listeners;
+    evutil_socket_t old[MAX_LISTEN_ADDRS];
+    struct event *old_events[MAX_LISTEN_ADDRS];
+    struct evconnlistener *old_lev[MAX_LISTEN_ADDRS];
+    memcpy(old, w->listeners, sizeof(old));
+    memcpy(old_events, w->event_listeners, sizeof(old_events));
+    memcpy(old_lev, w->lev_listeners, sizeof(old_lev));
+
+    w->num_listeners = 0;
+    w->num_lev_listeners = 0;
+    if (open_worker_listeners(w, r) < 0) {
+        log_msg(LOG_INFO, "Worker %d keeps its old listeners\n", w->id);
+        close_worker_listeners(w);
+        memcpy(w->listeners, old, sizeof(old));
+        memcpy(w->event_listeners, old_events, sizeof(old_events));
+        memcpy(w->lev_listeners, old_lev, sizeof(old_lev));
+        w->num_listeners = num_old;
+        w->num_lev_listeners = num_old_lev;
+        return;
+    }
+    if (w->accept_paused) {
+        set_accepting(w, 0);
+    }
+
+    for (int i = 0; i < num_old; ++i) {
+        event_free(old_events[i]);
+        drain_raw_listener(w, old[i]);
+        evutil_closesocket(old[i]);
+    }
+    for (int i = 0; i < num_old_lev; ++i) {
+        drain_lev_listener(w, old_lev[i]);
+        evconnlistener_free(old_lev[i]);
+    }
+    if (w->id == 0) {
+        unlink_old_unix_listeners(r->old_raw_addrs, r->num_old_raw_addrs,
+                                  config.raw_addrs, config.num_raw_addrs);
+        unlink_old_unix_listeners(r->old_lev_addrs, r->num_old_lev_addrs,
+                                  config.lev_addrs, config.num_lev_addrs);
+    }
+    log_msg(LOG_INFO, "Worker %d swapped its listeners\n", w->id);
+}
+
+// Runs on each worker once the main thread has updated config. Also run
+// from free_worker, by which time the listeners are best left alone.
+void handle_reload(struct worker_t *w, struct worker_msg_t *msg) {
+    struct reload_t *r = ((struct reload_msg_t*) msg)->reload;
+
+    // libevent hands back the same queue for a duration it has seen before,
+    // but keeps at most 256 of them. Past that it's a plain timeout, in the
+    // heap like any other.
+    if (r->idle_timeout_changed && w->idle_timeout) {
+        w->idle_tv.tv_sec = config.idle_timeout_s;
+        const struct timeval *idle_timeout =
+            event_base_init_common_timeout(w->base, &w->idle_tv);
+        w->idle_timeout = idle_timeout ? idle_timeout : &w->idle_tv;
+    }
+    if ((r->idle_timeout_changed && w->idle_timeout && !w->draining) || r->rate_limit_changed) {
+        for (struct conn_state_t *state = w->conn_pool.active; state; state = state->next) {
+            reload_conn(state, r);
+        }
+    }
+    // The group keeps a copy of the settings
+    if (r->rate_limit_changed && w->rate_group) {
+        bufferevent_rate_limit_group_set_cfg(w->rate_group, group_rate_cfg);
+    }
+    if (r->listeners_changed && !w->draining) {
+        swap_listeners(w, r);
+    }
+    if (r->max_conns_raised) {
+        maybe_resume_accepting(w);
+    }
+
+    if (__atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (r->old_conn_rate_cfg) {
+            ev_token_bucket_cfg_free(r->old_conn_rate_cfg);
+        }
+        free(r->old_conn_limits);
+        free(r);
+        __atomic_store_n(&reload_busy, 0, __ATOMIC_RELEASE);
+    }
+}
+
+void *run_worker(void *arg) {
+    struct worker_t *w = arg;
+
+    thread_log = &w->log;
+    if (config.loop_once) {
+        // One iteration waits for events and runs everything that became
+        // active, so counting callbacks across it shows how much gets batched
+        while (!event_base_got_exit(w->base) && !event_base_got_break(w->base)) {
+            w->iteration_callbacks = 0;
+            if (event_base_loop(w->base, EVLOOP_ONCE) != 0) {
+                break;
+            }
+            stat_hist_record(&w->stats.loop_callbacks, w->iteration_callbacks);
+            TRACE2(loop, w->id, w->iteration_callbacks);
+        }
+    } else {
+        event_base_dispatch(w->base);
+    }
+    log_flush();
+    thread_log = NULL;
+    return NULL;
+}
+
+void cb_acceptor_resume(evutil_socket_t fd, short what, void *arg) {
+    for (int i = 0; i < acceptor->num_listeners; ++i) {
+        evconnlistener_enable(acceptor->listeners[i]);
+    }
+}
+
+// The accept failed for a reason that doesn't go away by itself, like running
+// out of file descriptors. The listener stays readable, so rather than spin on
+// it, it's turned off until the backoff is over.
+void cb_acceptor_error(struct evconnlistener *listener, void *ctx) {
+    struct timeval backoff = {0, ACCEPT_BACKOFF_MS * 1000};
+
+    perror("Failed to accept connection\n");
+    evconnlistener_disable(listener);
+    event_add(acceptor->event_resume, &backoff);
+}
+
+int setup_acceptor() {
+    acceptor = calloc(1, sizeof(struct acceptor_t));
+    if (acceptor == NULL) {
+        perror("Failed to calloc acceptor\n");
+        return -1;
+    }
+    acceptor->base = new_event_base();
+    if (!acceptor->base) {
+        perror("Failed to create event base\n");
+        return -1;
+    }
+    acceptor->event_resume = evtimer_new(acceptor->base, cb_acceptor_resume, NULL);
+    if (!acceptor->event_resume) {
+        perror("Failed to create resume event\n");
+        return -1;
+    }
+
+    for (int i = 0; i < config.num_lev_addrs; ++i) {
+        evutil_socket_t listener = open_listener(&config.lev_addrs[i], config.backlog, -1, 0);
+        if (listener < 0) {
+            return -1;
+        }
+        struct evconnlistener *lev_listener = evconnlistener_new(
+            acceptor->base, cb_acceptor_accept, NULL, LEV_OPT_CLOSE_ON_FREE, 0, listener);
+        if (!lev_listener) {
+            perror("Failed to create lev listener\n");
+            evutil_closesocket(listener);
+            return -1;
+        }
+        evconnlistener_set_error_cb(lev_listener, cb_acceptor_error);
+        acceptor->listeners[acceptor->num_listeners++] = lev_listener;
+    }
+    return 0;
+}
+
+void *run_acceptor(void *arg) {
+    event_base_dispatch(acceptor->base);
+    return NULL;
+}
+
+void free_acceptor() {
+    for (int i = 0; i < acceptor->num_listeners; ++i) {
+        evconnlistener_free(acceptor->listeners[i]);
+    }
+    if (acceptor->event_resume) {
+        event_free(acceptor->event_resume);
+    }
+    event_base_free(acceptor->base);
+    free(acceptor);
+}
+
+void usage(const char *prog) {
+    printf(
+        "Usage: %s [options]\n"
+        "  -t, --threads N   run N worker threads, each with its own event loop\n"
+        "                    and SO_REUSEPORT listeners (default: 1)\n"
+        "  --read-buf-size N read up to N bytes per recv() (default: 65536)\n"
+        "  --read-budget N   read at most N times from one connection before\n"
+        "                    yielding to others (default: 16)\n"
+        "  --log-level L     one of off, info, debug, hexdump (default: hexdump)\n"
+        "  --log-rate-limit N\n"
+        "                    log at most N reads per connection per second,\n"
+        "                    0 for no limit (default: 10)\n"
+        "  --raw-listen ADDR listen for raw connections on ADDR: IPv4:PORT,\n"
+        "                    [IPv6]:PORT or unix:PATH, can be repeated\n"
+        "                    (default: 0.0.0.0:8888)\n"
+        "  --lev-listen ADDR same for bufferevent connections (default: 0.0.0.0:7777)\n"
+        "  --backlog N       listen() backlog for both listeners (default: SOMAXCONN)\n"
+        "  --accept-batch N  accept at most N connections on :8888 per wakeup\n"
+        "                    (default: 64)\n"
+        "  --nodelay         disable Nagle's algorithm (TCP_NODELAY)\n"
+        "  --quickack        ack right away rather than delaying acks (TCP_QUICKACK)\n"
+        "  --rcvbuf N, --sndbuf N\n"
+        "                    socket receive and send buffer sizes (default: system)\n"
+        "  --defer-accept N  only accept connections once they've sent data, waiting\n"
+        "                    up to N seconds (TCP_DEFER_ACCEPT) (default: off)\n"
+        "  --fastopen N      allow TCP Fast Open with a queue of N (default: off)\n"
+        "  --busy-poll N     busy poll the device for up to N us on blocking reads\n"
+        "                    (SO_BUSY_POLL) (default: off)\n"
+        "  --keepalive IDLE[,INTVL[,CNT]]\n"
+        "                    send keepalives after IDLE seconds, then every INTVL\n"
+        "                    seconds, giving up after CNT (default: off, 75,9)\n"
+        "  --echo            echo everything back to the sender\n"
+        "  --write-high-watermark N\n"
+        "                    stop reading from a peer with more than N bytes of\n"
+        "                    unsent replies (default: 262144)\n"
+        "  --write-low-watermark N\n"
+        "                    resume reading once that drops to N (default: 65536)\n"
+        "  --idle-timeout N  close connections that have been idle for N seconds,\n"
+        "                    0 to never close them (default: 300)\n"
+        "  --event-log FILE  record accepts, reads and closes to FILE in a binary\n"
+        "                    format that evdecode reads\n"
+        "  --event-log-size N\n"
+        "                    keep the last N records (default: 1048576)\n"
+        "  --timer-wheel     time idle connections with a timer wheel per worker\n"
+        "                    instead of libevent timeouts\n"
+        "  --grace-period N  on SIGINT or SIGTERM, give connections up to N seconds\n"
+        "                    to flush their output (default: 5)\n"
+        "  --max-conns N     stop accepting while N connections are open on all\n"
+        "                    threads and ports, 0 for no limit (default: 0)\n"
+        "  --max-conns-per-ip N\n"
+        "                    close connections beyond N from the same address,\n"
+        "                    0 for no limit (default: 0)\n"
+        "  --rate-limit N    limit each connection to reading (and on :7777, also\n"
+        "                    writing) N bytes/s, 0 for no limit (default: 0)\n"
+        "  --rate-burst N    let a connection go up to N bytes over the rate before\n"
+        "                    it's held back (default: one second's worth)\n"
+        "  --global-rate-limit N\n"
+        "                    limit all connections together to N bytes/s, split\n"
+        "                    evenly between the threads (default: 0)\n"
+        "  --tls-cert FILE   speak TLS on :7777 with this PEM certificate chain...\n"
+        "  --tls-key FILE    ...and this PEM private key\n"
+        "  --tls-cache-size N\n"
+        "                    keep up to N TLS sessions for resumption (default: 20480)\n"
+        "  --admin-port N    serve Prometheus metrics on http://0.0.0.0:N/metrics\n"
+        "                    (default: disabled)\n"
+        "  --framing F       split input into frames: none, line or\n"
+        "                    length (4 byte big endian prefix) (default: none)\n"
+        "  --max-frame-size N\n"
+        "                    disconnect peers sending frames over N bytes\n"
+        "                    (default: 1048576)\n"
+        "  --lev-priority N  event priority of :7777 connections, 0 (most urgent)\n"
+        "                    to 2 (default: 2)\n"
+        "  --lev-defer-callbacks\n"
+        "                    run :7777 bufferevent callbacks from the loop instead\n"
+        "                    of as soon as something happens\n"
+        "  --lev-threadsafe  give each :7777 bufferevent a lock\n"
+        "  --acceptor-thread accept :7777 connections on a thread of their own\n"
+        "                    and hand them to the workers in turn\n"
+        "  --backend NAME    require an event backend, e.g. epoll, poll or select\n"
+        "  --avoid-backend NAME\n"
+        "                    never use this event backend (can be repeated)\n"
+        "  --nolock          don't lock the event bases (only with --threads 1)\n"
+        "  --epoll-changelist\n"
+        "                    batch epoll_ctl changes until the next epoll_wait\n"
+        "  --precise-timer   use a precise (but costlier) timer mechanism\n"
+        "  --max-dispatch-us N\n"
+        "                    check timers and signals again after running\n"
+        "                    connection callbacks for N microseconds\n"
+        "  --max-dispatch-callbacks N\n"
+        "                    ...or after N connection callbacks\n"
+        "  --loop-once       drive the loop with EVLOOP_ONCE and count callbacks\n"
+        "                    per iteration\n"
+        "  --io-uring        accept and read on the raw listeners through io_uring,\n"
+        "                    if the kernel supports it (not with rate limits)\n"
+        "  --pin-cpus LIST   pin worker threads to these CPUs in turn, e.g. 0-3,8\n"
+        "  --incoming-cpu    have each worker's listeners take the connections\n"
+        "                    whose packets its CPU handles (SO_INCOMING_CPU)\n"
+        "  --rebalance       on every stats timer, move connections from the busiest\n"
+        "                    worker to the idlest one if it's reading much more\n"
+        "  --stats-interval N\n"
+        "                    run the stats timer every N seconds (default: 30)\n"
+        "  --config FILE     read options from FILE, one name = value per line;\n"
+        "                    it's read again on SIGHUP\n"
+        "  -h, --help        show this help\n",
+        prog
+    );
+}
+
+int parse_log_level(const char *name, enum log_level_t *level) {
+    for (int i = LOG_OFF; i <= LOG_HEXDUMP; ++i) {
+        if (strcmp(name, LOG_LEVEL_NAMES[i]) == 0) {
+            *level = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// A list of CPUs like 0-3,8,10-11, in the order workers are given them
+int parse_cpu_list(struct config_t *cfg, const char *text) {
+    cfg->num_cpus = 0;
+    const char *p = text;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end != p && *end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+        }
+        if (end == p || (*end && *end != ',') || first < 0 || last < first ||
+            last >= CPU_SETSIZE || cfg->num_cpus + (last - first) >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            cfg->cpus[cfg->num_cpus++] = cpu;
+        }
+        p = *end ? end + 1 : end;
+    }
+    return cfg->num_cpus > 0 ? 0 : -1;
+}
+
+int parse_framing(const char *name, enum framing_t *framing) {
+    for (int i = FRAMING_NONE; i <= FRAMING_LENGTH; ++i) {
+        if (strcmp(name, FRAMING_NAMES[i]) == 0) {
+            *framing = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Values for options that only have a long form
+enum {
+    OPT_READ_BUF_SIZE = 256,
+    OPT_READ_BUDGET,
+    OPT_LOG_LEVEL,
+    OPT_LOG_RATE_LIMIT,
+    OPT_BACKLOG,
+    OPT_ACCEPT_BATCH,
+    OPT_ECHO,
+    OPT_WRITE_HIGH_WM,
+    OPT_WRITE_LOW_WM,
+    OPT_IDLE_TIMEOUT,
+    OPT_GRACE_PERIOD,
+    OPT_MAX_CONNS,
+    OPT_MAX_CONNS_PER_IP,
+    OPT_RATE_LIMIT,
+    OPT_RATE_BURST,
+    OPT_GLOBAL_RATE_LIMIT,
+    OPT_TLS_CERT,
+    OPT_TLS_KEY,
+    OPT_TLS_CACHE_SIZE,
+    OPT_ADMIN_PORT,
+    OPT_FRAMING,
+    OPT_MAX_FRAME_SIZE,
+    OPT_LEV_PRIORITY,
+    OPT_RAW_LISTEN,
+    OPT_LEV_LISTEN,
+    OPT_NODELAY,
+    OPT_QUICKACK,
+    OPT_RCVBUF,
+    OPT_SNDBUF,
+    OPT_DEFER_ACCEPT,
+    OPT_FASTOPEN,
+    OPT_BUSY_POLL,
+    OPT_KEEPALIVE,
+    OPT_BACKEND,
+    OPT_AVOID_BACKEND,
+    OPT_NOLOCK,
+    OPT_EPOLL_CHANGELIST,
+    OPT_PRECISE_TIMER,
+    OPT_IO_URING,
+    OPT_LEV_DEFER_CALLBACKS,
+    OPT_LEV_THREADSAFE,
+    OPT_MAX_DISPATCH_US,
+    OPT_MAX_DISPATCH_CALLBACKS,
+    OPT_LOOP_ONCE,
+    OPT_ACCEPTOR_THREAD,
+    OPT_TIMER_WHEEL,
+    OPT_EVENT_LOG,
+    OPT_EVENT_LOG_SIZE,
+    OPT_PIN_CPUS,
+    OPT_INCOMING_CPU,
+    OPT_REBALANCE,
+    OPT_STATS_INTERVAL,
+    OPT_CONFIG,
 };
 
-struct conn_state_t *alloc_conn_state() {
-    struct conn_state_t *state = calloc(sizeof(struct conn_state_t), 1);
-    if (state == NULL) {
-        perror("Failed to calloc conn_state_t\n");
+// Add an address to a list of addresses to listen on
+int parse_listen_addr(const char *text, struct listen_addr_t *addrs, int *num) {
+    if (*num == MAX_LISTEN_ADDRS) {
+        fprintf(stderr, "Too many addresses to listen on\n");
+        return -1;
     }
-    return state;
+    struct listen_addr_t *la = &addrs[*num];
+    memset(la, 0, sizeof(*la));
+    if (strlen(text) >= sizeof(la->text)) {
+        fprintf(stderr, "Invalid address: %s\n", text);
+        return -1;
+    }
+    strcpy(la->text, text);
+
+    if (strncmp(text, "unix:", 5) == 0) {
+        struct sockaddr_un *sun = (struct sockaddr_un*) &la->ss;
+        const char *path = text + 5;
+        if (*path == '\0' || strlen(path) >= sizeof(sun->sun_path)) {
+            fprintf(stderr, "Invalid socket path: %s\n", path);
+            return -1;
+        }
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, path);
+        la->len = sizeof(*sun);
+    } else {
+        int len = sizeof(la->ss);
+        uint16_t port;
+        char buf[INET6_ADDRSTRLEN];
+        if (evutil_parse_sockaddr_port(text, (struct sockaddr*) &la->ss, &len) < 0) {
+            fprintf(stderr, "Invalid address: %s\n", text);
+            return -1;
+        }
+        format_address((struct sockaddr*) &la->ss, buf, sizeof(buf), &port);
+        if (port == 0) {
+            fprintf(stderr, "Address needs a port: %s\n", text);
+            return -1;
+        }
+        la->len = len;
+    }
+
+    (*num)++;
+    return 0;
 }
 
-const char* format_address(uint32_t addr) {
-    addr = htonl(addr);
-    int first = (addr & 0xff000000) >> 24;
-    int second = (addr & 0x00ff0000) >> 16;
-    int third = (addr & 0x0000ff00) >> 8;
-    int fourth = (addr & 0x000000ff);
+// IPv6 listeners only take IPv4 connections too when there is no IPv4
+// listener on the same port in the list
+void set_v6only(struct listen_addr_t *addrs, int num) {
+    for (int i = 0; i < num; ++i) {
+        if (addrs[i].ss.ss_family != AF_INET6) {
+            continue;
+        }
+        in_port_t port = ((struct sockaddr_in6*) &addrs[i].ss)->sin6_port;
+        for (int j = 0; j < num; ++j) {
+            if (addrs[j].ss.ss_family == AF_INET &&
+                ((struct sockaddr_in*) &addrs[j].ss)->sin_port == port) {
+                addrs[i].v6only = 1;
+            }
+        }
+    }
+}
 
-    char *buf = malloc(15);
-    if (buf == NULL) {
-        perror("Failed to malloc address buffer\n");
-        return NULL;
+int backend_supported(const char *name) {
+    const char **methods = event_get_supported_methods();
+    for (int i = 0; methods[i] != NULL; ++i) {
+        if (strcmp(methods[i], name) == 0) {
+            return 1;
+        }
     }
+    return 0;
+}
 
-    sprintf(buf, "%d.%d.%d.%d", first, second, third, fourth);
-    return buf;
+const struct option LONG_OPTIONS[] = {
+    {"threads",       required_argument, NULL, 't'},
+    {"read-buf-size", required_argument, NULL, OPT_READ_BUF_SIZE},
+    {"read-budget",   required_argument, NULL, OPT_READ_BUDGET},
+    {"log-level",     required_argument, NULL, OPT_LOG_LEVEL},
+    {"log-rate-limit", required_argument, NULL, OPT_LOG_RATE_LIMIT},
+    {"backlog",       required_argument, NULL, OPT_BACKLOG},
+    {"accept-batch",  required_argument, NULL, OPT_ACCEPT_BATCH},
+    {"echo",          no_argument,       NULL, OPT_ECHO},
+    {"write-high-watermark", required_argument, NULL, OPT_WRITE_HIGH_WM},
+    {"write-low-watermark",  required_argument, NULL, OPT_WRITE_LOW_WM},
+    {"idle-timeout",  required_argument, NULL, OPT_IDLE_TIMEOUT},
+    {"grace-period",  required_argument, NULL, OPT_GRACE_PERIOD},
+    {"max-conns",     required_argument, NULL, OPT_MAX_CONNS},
+    {"max-conns-per-ip", required_argument, NULL, OPT_MAX_CONNS_PER_IP},
+    {"rate-limit",    required_argument, NULL, OPT_RATE_LIMIT},
+    {"rate-burst",    required_argument, NULL, OPT_RATE_BURST},
+    {"global-rate-limit", required_argument, NULL, OPT_GLOBAL_RATE_LIMIT},
+    {"tls-cert",      required_argument, NULL, OPT_TLS_CERT},
+    {"tls-key",       required_argument, NULL, OPT_TLS_KEY},
+    {"tls-cache-size", required_argument, NULL, OPT_TLS_CACHE_SIZE},
+    {"admin-port",    required_argument, NULL, OPT_ADMIN_PORT},
+    {"framing",       required_argument, NULL, OPT_FRAMING},
+    {"max-frame-size", required_argument, NULL, OPT_MAX_FRAME_SIZE},
+    {"lev-priority",  required_argument, NULL, OPT_LEV_PRIORITY},
+    {"raw-listen",    required_argument, NULL, OPT_RAW_LISTEN},
+    {"lev-listen",    required_argument, NULL, OPT_LEV_LISTEN},
+    {"nodelay",       no_argument,       NULL, OPT_NODELAY},
+    {"quickack",      no_argument,       NULL, OPT_QUICKACK},
+    {"rcvbuf",        required_argument, NULL, OPT_RCVBUF},
+    {"sndbuf",        required_argument, NULL, OPT_SNDBUF},
+    {"defer-accept",  required_argument, NULL, OPT_DEFER_ACCEPT},
+    {"fastopen",      required_argument, NULL, OPT_FASTOPEN},
+    {"busy-poll",     required_argument, NULL, OPT_BUSY_POLL},
+    {"keepalive",     required_argument, NULL, OPT_KEEPALIVE},
+    {"backend",       required_argument, NULL, OPT_BACKEND},
+    {"avoid-backend", required_argument, NULL, OPT_AVOID_BACKEND},
+    {"nolock",        no_argument,       NULL, OPT_NOLOCK},
+    {"epoll-changelist", no_argument,    NULL, OPT_EPOLL_CHANGELIST},
+    {"precise-timer", no_argument,       NULL, OPT_PRECISE_TIMER},
+    {"io-uring",      no_argument,       NULL, OPT_IO_URING},
+    {"lev-defer-callbacks", no_argument, NULL, OPT_LEV_DEFER_CALLBACKS},
+    {"lev-threadsafe", no_argument,      NULL, OPT_LEV_THREADSAFE},
+    {"max-dispatch-us", required_argument, NULL, OPT_MAX_DISPATCH_US},
+    {"max-dispatch-callbacks", required_argument, NULL, OPT_MAX_DISPATCH_CALLBACKS},
+    {"loop-once",     no_argument,       NULL, OPT_LOOP_ONCE},
+    {"acceptor-thread", no_argument,     NULL, OPT_ACCEPTOR_THREAD},
+    {"timer-wheel",   no_argument,       NULL, OPT_TIMER_WHEEL},
+    {"event-log",     required_argument, NULL, OPT_EVENT_LOG},
+    {"event-log-size", required_argument, NULL, OPT_EVENT_LOG_SIZE},
+    {"pin-cpus",      required_argument, NULL, OPT_PIN_CPUS},
+    {"incoming-cpu",  no_argument,       NULL, OPT_INCOMING_CPU},
+    {"rebalance",     no_argument,       NULL, OPT_REBALANCE},
+    {"stats-interval", required_argument, NULL, OPT_STATS_INTERVAL},
+    {"config",        required_argument, NULL, OPT_CONFIG},
+    {"help",          no_argument,       NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
+
+// Apply one option, from the command line or a config file
+int parse_option(struct config_t *cfg, int opt, const char *arg) {
+    switch (opt) {
+    case 't':
+        cfg->num_threads = atoi(arg);
+        if (cfg->num_threads < 1) {
+            fprintf(stderr, "Invalid number of threads: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_READ_BUF_SIZE:
+        cfg->read_buf_size = strtoul(arg, NULL, 10);
+        if (cfg->read_buf_size < 1) {
+            fprintf(stderr, "Invalid read buffer size: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_READ_BUDGET:
+        cfg->read_budget = atoi(arg);
+        if (cfg->read_budget < 1) {
+            fprintf(stderr, "Invalid read budget: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_LOG_LEVEL:
+        if (parse_log_level(arg, &cfg->log_level) < 0) {
+            fprintf(stderr, "Invalid log level: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_LOG_RATE_LIMIT:
+        cfg->log_rate_limit = atoi(arg);
+        if (cfg->log_rate_limit < 0) {
+            fprintf(stderr, "Invalid log rate limit: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_BACKLOG:
+        cfg->backlog = atoi(arg);
+        if (cfg->backlog < 1) {
+            fprintf(stderr, "Invalid backlog: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_ACCEPT_BATCH:
+        cfg->accept_batch = atoi(arg);
+        if (cfg->accept_batch < 1) {
+            fprintf(stderr, "Invalid accept batch: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_ECHO:
+        cfg->echo = 1;
+        break;
+    case OPT_WRITE_HIGH_WM:
+        cfg->write_high_wm = strtoul(arg, NULL, 10);
+        if (cfg->write_high_wm < 1) {
+            fprintf(stderr, "Invalid write high watermark: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_WRITE_LOW_WM:
+        cfg->write_low_wm = strtoul(arg, NULL, 10);
+        break;
+    case OPT_IDLE_TIMEOUT:
+        cfg->idle_timeout_s = atoi(arg);
+        if (cfg->idle_timeout_s < 0) {
+            fprintf(stderr, "Invalid idle timeout: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_GRACE_PERIOD:
+        cfg->grace_period_s = atoi(arg);
+        if (cfg->grace_period_s < 0) {
+            fprintf(stderr, "Invalid grace period: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_MAX_CONNS:
+        cfg->max_conns = strtoul(arg, NULL, 10);
+        break;
+    case OPT_MAX_CONNS_PER_IP:
+        cfg->max_conns_per_ip = atoi(arg);
+        if (cfg->max_conns_per_ip < 0) {
+            fprintf(stderr, "Invalid per address limit: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_RATE_LIMIT:
+        cfg->rate_limit = strtoul(arg, NULL, 10);
+        break;
+    case OPT_RATE_BURST:
+        cfg->rate_burst = strtoul(arg, NULL, 10);
+        break;
+    case OPT_GLOBAL_RATE_LIMIT:
+        cfg->global_rate_limit = strtoul(arg, NULL, 10);
+        break;
+    case OPT_TLS_CERT:
+        cfg->tls_cert = arg;
+        break;
+    case OPT_TLS_KEY:
+        cfg->tls_key = arg;
+        break;
+    case OPT_TLS_CACHE_SIZE:
+        cfg->tls_cache_size = atol(arg);
+        if (cfg->tls_cache_size < 0) {
+            fprintf(stderr, "Invalid TLS session cache size: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_ADMIN_PORT:
+        cfg->admin_port = atoi(arg);
+        if (cfg->admin_port < 0 || cfg->admin_port > 65535) {
+            fprintf(stderr, "Invalid admin port: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_FRAMING:
+        if (parse_framing(arg, &cfg->framing) < 0) {
+            fprintf(stderr, "Invalid framing: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_MAX_FRAME_SIZE:
+        cfg->max_frame_size = strtoul(arg, NULL, 10);
+        if (cfg->max_frame_size < 1) {
+            fprintf(stderr, "Invalid max frame size: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_LEV_PRIORITY:
+        cfg->lev_priority = atoi(arg);
+        if (cfg->lev_priority < 0 || cfg->lev_priority >= NUM_PRIORITIES) {
+            fprintf(stderr, "Invalid priority: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_RAW_LISTEN:
+        if (parse_listen_addr(arg, cfg->raw_addrs, &cfg->num_raw_addrs) < 0) {
+            return -1;
+        }
+        break;
+    case OPT_LEV_LISTEN:
+        if (parse_listen_addr(arg, cfg->lev_addrs, &cfg->num_lev_addrs) < 0) {
+            return -1;
+        }
+        break;
+    case OPT_NODELAY:
+        cfg->nodelay = 1;
+        break;
+    case OPT_QUICKACK:
+        cfg->quickack = 1;
+        break;
+    case OPT_RCVBUF:
+        cfg->rcvbuf = atoi(arg);
+        if (cfg->rcvbuf < 1) {
+            fprintf(stderr, "Invalid receive buffer size: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_SNDBUF:
+        cfg->sndbuf = atoi(arg);
+        if (cfg->sndbuf < 1) {
+            fprintf(stderr, "Invalid send buffer size: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_DEFER_ACCEPT:
+        cfg->defer_accept_s = atoi(arg);
+        if (cfg->defer_accept_s < 1) {
+            fprintf(stderr, "Invalid defer accept timeout: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_FASTOPEN:
+        cfg->fastopen_qlen = atoi(arg);
+        if (cfg->fastopen_qlen < 1) {
+            fprintf(stderr, "Invalid fast open queue length: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_BUSY_POLL:
+        cfg->busy_poll_us = atoi(arg);
+        if (cfg->busy_poll_us < 1) {
+            fprintf(stderr, "Invalid busy poll time: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_KEEPALIVE:
+        cfg->keepalive_intvl_s = 75;
+        cfg->keepalive_cnt = 9;
+        if (sscanf(arg, "%d,%d,%d", &cfg->keepalive_idle_s, &cfg->keepalive_intvl_s,
+                   &cfg->keepalive_cnt) < 1 ||
+            cfg->keepalive_idle_s < 1 || cfg->keepalive_intvl_s < 1 ||
+            cfg->keepalive_cnt < 1) {
+            fprintf(stderr, "Invalid keepalive: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_BACKEND:
+        if (!backend_supported(arg)) {
+            fprintf(stderr, "Invalid backend: %s\n", arg);
+            return -1;
+        }
+        cfg->backend = arg;
+        break;
+    case OPT_AVOID_BACKEND:
+        if (cfg->num_avoid_backends == 8) {
+            fprintf(stderr, "Too many backends to avoid\n");
+            return -1;
+        }
+        cfg->avoid_backends[cfg->num_avoid_backends++] = arg;
+        break;
+    case OPT_NOLOCK:
+        cfg->base_flags |= EVENT_BASE_FLAG_NOLOCK;
+        break;
+    case OPT_EPOLL_CHANGELIST:
+        cfg->base_flags |= EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST;
+        break;
+    case OPT_PRECISE_TIMER:
+        cfg->base_flags |= EVENT_BASE_FLAG_PRECISE_TIMER;
+        break;
+    case OPT_IO_URING:
+        cfg->io_uring = 1;
+        break;
+    case OPT_LEV_DEFER_CALLBACKS:
+        cfg->lev_bev_options |= BEV_OPT_DEFER_CALLBACKS;
+        break;
+    case OPT_LEV_THREADSAFE:
+        cfg->lev_bev_options |= BEV_OPT_THREADSAFE;
+        break;
+    case OPT_MAX_DISPATCH_US:
+        cfg->max_dispatch_us = atoi(arg);
+        if (cfg->max_dispatch_us < 1) {
+            fprintf(stderr, "Invalid max dispatch time: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_MAX_DISPATCH_CALLBACKS:
+        cfg->max_dispatch_callbacks = atoi(arg);
+        if (cfg->max_dispatch_callbacks < 1) {
+            fprintf(stderr, "Invalid max dispatch callbacks: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_LOOP_ONCE:
+        cfg->loop_once = 1;
+        break;
+    case OPT_ACCEPTOR_THREAD:
+        cfg->acceptor_thread = 1;
+        break;
+    case OPT_TIMER_WHEEL:
+        cfg->timer_wheel = 1;
+        break;
+    case OPT_EVENT_LOG:
+        cfg->event_log = arg;
+        break;
+    case OPT_EVENT_LOG_SIZE:
+        cfg->event_log_size = strtoul(arg, NULL, 10);
+        if (cfg->event_log_size == 0) {
+            fprintf(stderr, "Invalid event log size: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_PIN_CPUS:
+        if (parse_cpu_list(cfg, arg) < 0) {
+            fprintf(stderr, "Invalid CPU list: %s\n", arg);
+            return -1;
+        }
+        break;
+    case OPT_INCOMING_CPU:
+        cfg->incoming_cpu = 1;
+        break;
+    case OPT_REBALANCE:
+        cfg->rebalance = 1;
+        break;
+    case OPT_STATS_INTERVAL:
+        cfg->stats_interval_s = atoi(arg);
+        if (cfg->stats_interval_s < 1) {
+            fprintf(stderr, "Invalid stats interval: %s\n", arg);
+            return -1;
+        }
+        break;
+    default:
+        return -1;
+    }
+    return 0;
 }
 
-void cb_timer(evutil_socket_t fd, short what, void *arg) {
-    struct timeval *tv = arg;
-    printf("Timer fired after %ld seconds!\n", tv->tv_sec);
+// Fill in defaults and check that the options go together
+int check_config(struct config_t *cfg) {
+    if (cfg->num_raw_addrs == 0) {
+        parse_listen_addr("0.0.0.0:8888", cfg->raw_addrs, &cfg->num_raw_addrs);
+    }
+    if (cfg->num_lev_addrs == 0) {
+        parse_listen_addr("0.0.0.0:7777", cfg->lev_addrs, &cfg->num_lev_addrs);
+    }
+    set_v6only(cfg->raw_addrs, cfg->num_raw_addrs);
+    set_v6only(cfg->lev_addrs, cfg->num_lev_addrs);
+
+    if (!cfg->tls_cert != !cfg->tls_key) {
+        fprintf(stderr, "--tls-cert and --tls-key go together\n");
+        return -1;
+    }
+
+    if (cfg->rate_burst == 0) {
+        cfg->rate_burst = cfg->rate_limit;
+    }
+    if (cfg->rate_limit && cfg->rate_burst < rate_per_tick(cfg->rate_limit)) {
+        fprintf(stderr, "Rate burst must be at least %zu\n", rate_per_tick(cfg->rate_limit));
+        return -1;
+    }
+    if (cfg->global_rate_limit && cfg->global_rate_limit / cfg->num_threads < 1000 / RATE_TICK_MS) {
+        fprintf(stderr, "Invalid global rate limit: %zu\n", cfg->global_rate_limit);
+        return -1;
+    }
+
+    // Reads through io_uring are as big as the kernel makes them, so none of
+    // the token buckets would be honoured
+    if (cfg->io_uring && (cfg->rate_limit || cfg->global_rate_limit)) {
+        fprintf(stderr, "--io-uring can't be used with rate limits\n");
+        return -1;
+    }
+
+    // A connection's io_uring recv and token bucket belong to its worker
+    if (cfg->rebalance && (cfg->io_uring || cfg->rate_limit || cfg->global_rate_limit)) {
+        fprintf(stderr, "--rebalance can't be used with --io-uring or rate limits\n");
+        return -1;
+    }
+
+    // Other workers' bases get poked from the main thread, which needs locks
+    if ((cfg->base_flags & EVENT_BASE_FLAG_NOLOCK) &&
+        (cfg->num_threads > 1 || cfg->acceptor_thread)) {
+        fprintf(stderr, "--nolock can only be used with a single thread\n");
+        return -1;
+    }
+
+    if (cfg->incoming_cpu && cfg->num_cpus == 0) {
+        fprintf(stderr, "--incoming-cpu needs --pin-cpus\n");
+        return -1;
+    }
+
+    // Nothing to keep track of
+    if (cfg->idle_timeout_s == 0) {
+        cfg->timer_wheel = 0;
+    }
+
+    if (cfg->write_low_wm > cfg->write_high_wm) {
+        fprintf(stderr, "Write low watermark can't be above the high watermark\n");
+        return -1;
+    }
+
+    return 0;
 }
 
-void cb_sigint(evutil_socket_t fd, short what, void *arg) {
-    struct event_base *base = arg;
+// Text of the config files read. Options point into it, so what's read at
+// startup is kept until exit.
+struct config_text_t {
+    struct config_text_t *next;
+    char text[];
+};
+
+struct config_text_t *config_texts;
 
-    printf("Got SIGINT - shutting down the event loop!\n");
-    event_base_loopexit(base, NULL);
+char *trim(char *str) {
+    while (isspace((unsigned char) *str)) {
+        ++str;
+    }
+    char *end = str + strlen(str);
+    while (end > str && isspace((unsigned char) end[-1])) {
+        *--end = '\0';
+    }
+    return str;
 }
 
-void cb_read_socket(evutil_socket_t fd, short what, void *arg) {
-    struct conn_state_t *state = arg;
+// A "name = value" line, named like the long option. Options that don't take
+// a value can be given on their own, or set to true/yes/on/1 or
+// false/no/off/0.
+int parse_config_line(struct config_t *cfg, const char *name, const char *value) {
+    const struct option *o = LONG_OPTIONS;
+    while (o->name && strcmp(o->name, name) != 0) {
+        ++o;
+    }
+    if (o->name == NULL || o->val == OPT_CONFIG || o->val == 'h') {
+        fprintf(stderr, "Unknown option: %s\n", name);
+        return -1;
+    }
+
+    if (o->has_arg == no_argument && value) {
+        if (strcmp(value, "false") == 0 || strcmp(value, "no") == 0 ||
+            strcmp(value, "off") == 0 || strcmp(value, "0") == 0) {
+            return 0;
+        }
+        if (strcmp(value, "true") != 0 && strcmp(value, "yes") != 0 &&
+            strcmp(value, "on") != 0 && strcmp(value, "1") != 0) {
+            fprintf(stderr, "Invalid value for %s: %s\n", name, value);
+            return -1;
+        }
+        value = NULL;
+    }
+    if (o->has_arg == required_argument && (value == NULL || *value == '\0')) {
+        fprintf(stderr, "%s needs a value\n", name);
+        return -1;
+    }
+    return parse_option(cfg, o->val, value);
+}
 
-    const char* addr = format_address(state->sin.sin_addr.s_addr);
-    int port = state->sin.sin_port;
+// Options from a file, one per line. Blank lines and anything after a # are
+// ignored.
+int load_config_file(struct config_t *cfg, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct config_text_t *ct = NULL;
+    long size = -1;
+    if (fseek(f, 0, SEEK_END) == 0) {
+        size = ftell(f);
+    }
+    if (size >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+        ct = malloc(sizeof(struct config_text_t) + size + 1);
+    }
+    if (ct == NULL || fread(ct->text, 1, size, f) != (size_t) size) {
+        fprintf(stderr, "Failed to read %s\n", path);
+        free(ct);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    ct->text[size] = '\0';
+    ct->next = config_texts;
+    config_texts = ct;
 
-    char buf[1024];
-    ssize_t num_read = recv(fd, buf, sizeof(buf), 0);
+    char *line = ct->text;
+    for (int lineno = 1; line; ++lineno) {
+        char *next = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        }
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char *value = strchr(line, '=');
+        if (value) {
+            *value++ = '\0';
+            value = trim(value);
+        }
+        char *name = trim(line);
+        if (*name && parse_config_line(cfg, name, value) < 0) {
+            fprintf(stderr, "...on line %d of %s\n", lineno, path);
+            return -1;
+        }
+        line = next;
+    }
+    return 0;
+}
 
-    // There was actually nothing to read. We assume this means the peer
-    // disconnected so we remove the read event.
-    if (num_read < 1) {
-        printf("Peer %s:%d disconnected\n", addr, port);
-        event_del(state->event_read_socket);
-        return;
+// Free the texts read since the list was at last
+void free_config_texts(struct config_text_t *last) {
+    while (config_texts != last) {
+        struct config_text_t *ct = config_texts;
+        config_texts = ct->next;
+        free(ct);
     }
+}
 
-    printf("Read %ld bytes from peer: %s:%d: ", num_read, addr, port);
-    for (ssize_t i = 0; i < num_read; ++i) {
-        printf("%d ", buf[i]);
+// Options apply in the order they're given, so the ones after --config
+// override what's in the file. Resetting optind lets this run again on a
+// reload.
+int parse_args(struct config_t *cfg, int argc, char *argv[]) {
+    int opt;
+    optind = 0;
+    while ((opt = getopt_long(argc, argv, "t:h", LONG_OPTIONS, NULL)) != -1) {
+        if (opt == 'h') {
+            usage(argv[0]);
+            exit(0);
+        }
+        if (opt == OPT_CONFIG) {
+            cfg->config_file = optarg;
+            if (load_config_file(cfg, optarg) < 0) {
+                return -1;
+            }
+        } else if (parse_option(cfg, opt, optarg) < 0) {
+            if (opt == '?') {
+                usage(argv[0]);
+            }
+            return -1;
+        }
     }
-    printf("\n");
+    return check_config(cfg);
 }
 
-void cb_accept_conn(evutil_socket_t listener, short what, void *arg) {
-    printf("Got incoming connection on :8888!\n");
+// How each setting is handled on a reload
+enum setting_kind_t {
+    SETTING_LIVE,       // the new value is used from then on
+    SETTING_LIMIT,      // the same, but turning it on or off needs a restart
+    SETTING_LISTENER,   // the listeners are replaced
+    SETTING_RESTART,    // only read at startup
+    SETTING_RESTART_STR,
+};
 
-    struct event_base *base = arg;
+struct setting_t {
+    const char *name;
+    size_t offset;
+    size_t size;
+    enum setting_kind_t kind;
+};
 
-    // Accept the connection and add a new event that waits until we can read
-    // from the socket
-    struct conn_state_t *state = alloc_conn_state();
-    socklen_t slen = sizeof(state->sin);
+#define SETTING(name, field, kind) \
+    {name, offsetof(struct config_t, field), sizeof(((struct config_t*) 0)->field), kind}
 
-    int fd = accept(listener, (struct sockaddr*) &state->sin, &slen);
-    if (fd < 0) {
-        perror("Failed to accept connection\n");
-        return;
+const struct setting_t SETTINGS[] = {
+    SETTING("threads", num_threads, SETTING_RESTART),
+    SETTING("read-buf-size", read_buf_size, SETTING_RESTART),
+    SETTING("read-budget", read_budget, SETTING_LIVE),
+    SETTING("log-level", log_level, SETTING_LIVE),
+    SETTING("log-rate-limit", log_rate_limit, SETTING_LIVE),
+    SETTING("backlog", backlog, SETTING_LISTENER),
+    SETTING("accept-batch", accept_batch, SETTING_LIVE),
+    SETTING("nodelay", nodelay, SETTING_LISTENER),
+    SETTING("rcvbuf", rcvbuf, SETTING_LISTENER),
+    SETTING("sndbuf", sndbuf, SETTING_LISTENER),
+    SETTING("defer-accept", defer_accept_s, SETTING_LISTENER),
+    SETTING("quickack", quickack, SETTING_LIVE),
+    SETTING("fastopen", fastopen_qlen, SETTING_LISTENER),
+    SETTING("busy-poll", busy_poll_us, SETTING_LISTENER),
+    SETTING("keepalive", keepalive_idle_s, SETTING_LISTENER),
+    SETTING("keepalive", keepalive_intvl_s, SETTING_LISTENER),
+    SETTING("keepalive", keepalive_cnt, SETTING_LISTENER),
+    SETTING("echo", echo, SETTING_RESTART),
+    SETTING("write-high-watermark", write_high_wm, SETTING_LIVE),
+    SETTING("write-low-watermark", write_low_wm, SETTING_LIVE),
+    SETTING("idle-timeout", idle_timeout_s, SETTING_LIMIT),
+    SETTING("timer-wheel", timer_wheel, SETTING_RESTART),
+    SETTING("event-log", event_log, SETTING_RESTART_STR),
+    SETTING("event-log-size", event_log_size, SETTING_RESTART),
+    SETTING("grace-period", grace_period_s, SETTING_LIVE),
+    // The address table grows by itself, so it doesn't depend on this
+    SETTING("max-conns", max_conns, SETTING_LIMIT),
+    SETTING("max-conns-per-ip", max_conns_per_ip, SETTING_LIMIT),
+    SETTING("rate-limit", rate_limit, SETTING_LIMIT),
+    SETTING("rate-burst", rate_burst, SETTING_LIVE),
+    SETTING("global-rate-limit", global_rate_limit, SETTING_LIMIT),
+    SETTING("tls-cert", tls_cert, SETTING_RESTART_STR),
+    SETTING("tls-key", tls_key, SETTING_RESTART_STR),
+    SETTING("tls-cache-size", tls_cache_size, SETTING_RESTART),
+    SETTING("admin-port", admin_port, SETTING_RESTART),
+    SETTING("framing", framing, SETTING_RESTART),
+    SETTING("max-frame-size", max_frame_size, SETTING_LIVE),
+    SETTING("lev-priority", lev_priority, SETTING_RESTART),
+    SETTING("lev-defer-callbacks/lev-threadsafe", lev_bev_options, SETTING_RESTART),
+    SETTING("acceptor-thread", acceptor_thread, SETTING_RESTART),
+    SETTING("io-uring", io_uring, SETTING_RESTART),
+    SETTING("pin-cpus", cpus, SETTING_RESTART),
+    SETTING("pin-cpus", num_cpus, SETTING_RESTART),
+    SETTING("incoming-cpu", incoming_cpu, SETTING_LISTENER),
+    SETTING("rebalance", rebalance, SETTING_LIVE),
+    SETTING("stats-interval", stats_interval_s, SETTING_LIVE),
+    SETTING("backend", backend, SETTING_RESTART_STR),
+    SETTING("nolock/epoll-changelist/precise-timer", base_flags, SETTING_RESTART),
+    SETTING("max-dispatch-us", max_dispatch_us, SETTING_RESTART),
+    SETTING("max-dispatch-callbacks", max_dispatch_callbacks, SETTING_RESTART),
+    SETTING("loop-once", loop_once, SETTING_RESTART),
+};
+
+// The command line, parsed again on a reload
+int main_argc;
+char **main_argv;
+
+int is_zero(const void *p, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        if (((const unsigned char*) p)[i]) {
+            return 0;
+        }
     }
-    evutil_make_socket_nonblocking(fd);
+    return 1;
+}
 
-    state->event_read_socket = event_new(base, fd, EV_READ | EV_PERSIST,
-                                         cb_read_socket, (void*) state);
-    if (event_add(state->event_read_socket, NULL)) {
-        perror("Failed to add read socket event\n");
+int same_addrs(const struct listen_addr_t *a, int num_a, const struct listen_addr_t *b, int num_b) {
+    if (num_a != num_b) {
+        return 0;
     }
+    for (int i = 0; i < num_a; ++i) {
+        if (a[i].len != b[i].len || a[i].v6only != b[i].v6only ||
+            memcmp(&a[i].ss, &b[i].ss, a[i].len) != 0) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
-void cb_lev_event(struct bufferevent *bev, short events, void *ctx) {
-    if (events & BEV_EVENT_ERROR) {
-        perror("Error from bufferevent\n");
+// Whether next may keep a setting's new value. If not, it's put back to the
+// current one.
+int setting_can_change(const struct setting_t *s, struct config_t *next) {
+    void *cur = (char*) &config + s->offset;
+    void *val = (char*) next + s->offset;
+
+    if (s->kind == SETTING_RESTART_STR) {
+        const char *a = *(const char**) cur;
+        const char *b = *(const char**) val;
+        // Equal strings have to compare equal as pointers later too
+        memcpy(val, cur, s->size);
+        return (!a && !b) || (a && b && strcmp(a, b) == 0);
     }
-    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
-        printf("Peer disconnected\n");
-        bufferevent_free(bev);
+    if (memcmp(cur, val, s->size) == 0) {
+        return 1;
     }
+    if (s->kind == SETTING_RESTART ||
+        (s->kind == SETTING_LIMIT && is_zero(cur, s->size) != is_zero(val, s->size)) ||
+        (s->kind == SETTING_LISTENER && (config.io_uring || config.acceptor_thread))) {
+        memcpy(val, cur, s->size);
+        return 0;
+    }
+    return 1;
 }
 
-void cb_lev_read_socket(struct bufferevent *bev, void *ctx) {
-    char buf[1024];
-    size_t num_read = bufferevent_read(bev, &buf, sizeof(buf));
+// Workers read the live settings while this runs, so each one is stored in
+// one go. Those that have to change together are read through conn_limits.
+void store_setting(const struct setting_t *s, const struct config_t *next) {
+    void *cur = (char*) &config + s->offset;
+    const void *val = (const char*) next + s->offset;
 
-    printf("Read %ld bytes from peer: ", num_read);
-    for (ssize_t i = 0; i < num_read; ++i) {
-        printf("%d ", buf[i]);
+    if (s->size == sizeof(size_t)) {
+        __atomic_store_n((size_t*) cur, *(const size_t*) val, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n((int*) cur, *(const int*) val, __ATOMIC_RELAXED);
     }
-    printf("\n");
 }
 
-void cb_lev_accept(struct evconnlistener *listener, evutil_socket_t fd,
-                   struct sockaddr* addr, int socklen, void *ctx) {
-    printf("Got incoming connection on :7777!\n");
+// Apply what can be applied without a restart from a freshly parsed config
+void apply_config(struct config_t *next, struct event *event_timer) {
+    // Those that need a restart keep their value, which has to leave a
+    // config that still checks out
+    for (size_t i = 0; i < sizeof(SETTINGS) / sizeof(SETTINGS[0]); ++i) {
+        if (!setting_can_change(&SETTINGS[i], next)) {
+            log_msg(LOG_INFO, "Changing %s needs a restart\n", SETTINGS[i].name);
+        }
+    }
+    int same_avoid = next->num_avoid_backends == config.num_avoid_backends;
+    for (int i = 0; same_avoid && i < config.num_avoid_backends; ++i) {
+        same_avoid = strcmp(next->avoid_backends[i], config.avoid_backends[i]) == 0;
+    }
+    if (!same_avoid) {
+        log_msg(LOG_INFO, "Changing avoid-backend needs a restart\n");
+    }
+    int same_listeners = same_addrs(next->raw_addrs, next->num_raw_addrs,
+                                    config.raw_addrs, config.num_raw_addrs) &&
+                         same_addrs(next->lev_addrs, next->num_lev_addrs,
+                                    config.lev_addrs, config.num_lev_addrs);
+    if (!same_listeners && (config.io_uring || config.acceptor_thread)) {
+        log_msg(LOG_INFO, "Changing raw-listen or lev-listen needs a restart "
+                "with io-uring or acceptor-thread\n");
+        same_listeners = 1;
+        memcpy(next->raw_addrs, config.raw_addrs, sizeof(next->raw_addrs));
+        memcpy(next->lev_addrs, config.lev_addrs, sizeof(next->lev_addrs));
+        next->num_raw_addrs = config.num_raw_addrs;
+        next->num_lev_addrs = config.num_lev_addrs;
+    }
+    if (check_config(next) < 0) {
+        log_msg(LOG_INFO, "Failed to reload config, nothing changed\n");
+        return;
+    }
+
+    struct reload_t *r = calloc(1, sizeof(struct reload_t) +
+                                   config.num_threads * sizeof(struct reload_msg_t));
+    if (r == NULL) {
+        perror("Failed to calloc reload_t\n");
+        return;
+    }
+    struct config_t old = config;
+    for (size_t i = 0; i < sizeof(SETTINGS) / sizeof(SETTINGS[0]); ++i) {
+        const struct setting_t *s = &SETTINGS[i];
+        if (memcmp((char*) &config + s->offset, (char*) next + s->offset, s->size) == 0) {
+            continue;
+        }
+        log_msg(LOG_INFO, "Changed %s\n", s->name);
+        store_setting(s, next);
+        r->listeners_changed |= s->kind == SETTING_LISTENER;
+    }
+    // Only workers use the addresses, and only after they get the message
+    if (!same_listeners) {
+        log_msg(LOG_INFO, "Changed the listen addresses\n");
+        memcpy(r->old_raw_addrs, config.raw_addrs, sizeof(r->old_raw_addrs));
+        memcpy(r->old_lev_addrs, config.lev_addrs, sizeof(r->old_lev_addrs));
+        r->num_old_raw_addrs = config.num_raw_addrs;
+        r->num_old_lev_addrs = config.num_lev_addrs;
+        memcpy(config.raw_addrs, next->raw_addrs, sizeof(config.raw_addrs));
+        memcpy(config.lev_addrs, next->lev_addrs, sizeof(config.lev_addrs));
+        config.num_raw_addrs = next->num_raw_addrs;
+        config.num_lev_addrs = next->num_lev_addrs;
+        r->listeners_changed = 1;
+    }
+    config.config_file = next->config_file;
+
+    r->idle_timeout_changed = config.idle_timeout_s != old.idle_timeout_s;
+    r->max_conns_raised = config.max_conns > old.max_conns;
+    if (config.rate_limit != old.rate_limit || config.rate_burst != old.rate_burst ||
+        config.global_rate_limit != old.global_rate_limit) {
+        struct ev_token_bucket_cfg *conn_cfg = config.rate_limit ? new_conn_rate_cfg() : NULL;
+        struct ev_token_bucket_cfg *group_cfg =
+            config.global_rate_limit ? new_group_rate_cfg() : NULL;
+        r->old_conn_rate_cfg = conn_rate_cfg;
+        __atomic_store_n(&conn_rate_cfg, conn_cfg, __ATOMIC_RELEASE);
+        if (group_rate_cfg) {
+            ev_token_bucket_cfg_free(group_rate_cfg);
+        }
+        group_rate_cfg = group_cfg;
+        r->rate_limit_changed = 1;
+    }
+    if (config.write_low_wm != old.write_low_wm || config.write_high_wm != old.write_high_wm ||
+        config.rate_limit != old.rate_limit || config.rate_burst != old.rate_burst) {
+        struct conn_limits_t *limits = new_conn_limits();
+        if (limits) {
+            r->old_conn_limits = conn_limits;
+            __atomic_store_n(&conn_limits, limits, __ATOMIC_RELEASE);
+        }
+    }
+    // The next run of the timer is a whole new interval from now
+    if (config.stats_interval_s != old.stats_interval_s) {
+        TIMEOUT_S.tv_sec = config.stats_interval_s;
+        event_add(event_timer, &TIMEOUT_S);
+        rebalance_reset();
+    }
+
+    r->refs = config.num_threads;
+    __atomic_store_n(&reload_busy, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < config.num_threads; ++i) {
+        r->msgs[i].msg.handle = handle_reload;
+        r->msgs[i].reload = r;
+        worker_post(&workers[i], &r->msgs[i].msg);
+    }
+}
 
-    struct event_base *base = evconnlistener_get_base(listener);
-    struct bufferevent *bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+// Parse the command line and config file again, and apply what can be
+// applied without a restart. Anything that fails to parse leaves the current
+// settings as they are. config ends up with no pointers into the text read
+// here, so it's freed again straight away.
+void reload_config(struct event *event_timer) {
+    if (__atomic_load_n(&reload_busy, __ATOMIC_ACQUIRE)) {
+        log_msg(LOG_INFO, "Still applying the last reload, try again\n");
+        return;
+    }
+    log_msg(LOG_INFO, "Reloading config%s%s\n", config.config_file ? " from " : "",
+            config.config_file ? config.config_file : "");
+    struct config_text_t *texts = config_texts;
+    struct config_t next = CONFIG_DEFAULTS;
+    if (parse_args(&next, main_argc, main_argv) < 0) {
+        log_msg(LOG_INFO, "Failed to reload config, nothing changed\n");
+    } else {
+        apply_config(&next, event_timer);
+    }
+    free_config_texts(texts);
+}
 
-    bufferevent_setcb(bev, cb_lev_read_socket, NULL, cb_lev_event, NULL);
-    bufferevent_enable(bev, EV_READ);
+void cb_reload(evutil_socket_t sig, short events, void *arg) {
+    reload_config(arg);
 }
 
 int main(int argc, char *argv[]) {
-    struct event_base *base = event_base_new();
-    if (!base) {
-        perror("Failed to create event base\n");
+    config = CONFIG_DEFAULTS;
+    main_argc = argc;
+    main_argv = argv;
+    if (parse_args(&config, argc, argv) < 0) {
+        return 1;
+    }
+    TIMEOUT_S.tv_sec = config.stats_interval_s;
+
+    // Writing to a peer that has gone away should fail with EPIPE rather than
+    // kill the process
+    signal(SIGPIPE, SIG_IGN);
+
+    // Workers' bases are poked from the main thread on shutdown, and from the
+    // acceptor thread when there is one, so they need locking. Thread safe
+    // bufferevents need it to be able to make their locks.
+    if ((config.num_threads > 1 || config.acceptor_thread ||
+         (config.lev_bev_options & BEV_OPT_THREADSAFE)) &&
+        evthread_use_pthreads() < 0) {
+        perror("Failed to enable libevent threading support\n");
+        return 1;
+    }
+
+    // Shards start small and grow with the number of addresses connected
+    if (config.max_conns_per_ip > 0 && ip_table_init() < 0) {
+        return 1;
+    }
+
+    handler = config.framing == FRAMING_NONE ? &STREAM_HANDLER : &FRAME_HANDLER;
+
+    if (config.tls_cert) {
+        ssl_ctx = new_ssl_ctx();
+        if (ssl_ctx == NULL) {
+            return 1;
+        }
+    }
+
+    conn_limits = new_conn_limits();
+    if (conn_limits == NULL) {
+        return 1;
+    }
+    if (config.rate_limit) {
+        conn_rate_cfg = new_conn_rate_cfg();
+    }
+    if (config.global_rate_limit) {
+        group_rate_cfg = new_group_rate_cfg();
+    }
+
+    if (config.event_log && event_log_open() < 0) {
+        return 1;
+    }
+
+    workers = calloc(config.num_threads, sizeof(struct worker_t));
+    if (workers == NULL) {
+        perror("Failed to calloc workers\n");
+        return 1;
+    }
+
+    // Each pinned worker is set up with the main thread running on its CPU.
+    // Linux places pages on the NUMA node of the CPU that first touches them,
+    // so the worker's base, rings and stats end up local to it, as do the
+    // pools it grows later from its own thread.
+    cpu_set_t main_cpus;
+    if (config.num_cpus &&
+        pthread_getaffinity_np(pthread_self(), sizeof(main_cpus), &main_cpus)) {
+        perror("Failed to get CPU affinity\n");
+        return 1;
+    }
+    for (int i = 0; i < config.num_threads; ++i) {
+        int cpu = config.num_cpus ? config.cpus[i % config.num_cpus] : -1;
+        if (cpu >= 0 && pin_thread(pthread_self(), cpu, NULL) < 0) {
+            return 1;
+        }
+        workers[i].id = i;
+        workers[i].cpu = cpu;
+        if (setup_worker(&workers[i]) < 0) {
+            return 1;
+        }
+    }
+    // The acceptor and event log threads inherit this
+    if (config.num_cpus && pin_thread(pthread_self(), -1, &main_cpus) < 0) {
+        return 1;
+    }
+
+    if (config.acceptor_thread && setup_acceptor() < 0) {
         return 1;
     }
 
+    // The timer and signal events live on the main thread's base
+    struct event_base *base = workers[0].base;
+    log_event_base(base);
+
     // Add event that listens for timeouts.
     // Use stdin as fd in lieu of actual meaningful file/socket (because this is
     // just a timer so doesn't act on any IO anyway)
     evutil_socket_t fd_timer = 0;
     struct event *event_timer = event_new(base, fd_timer, EV_TIMEOUT | EV_PERSIST,
                                           cb_timer, &TIMEOUT_S);
+    event_priority_set(event_timer, PRIO_CONTROL);
     if (event_add(event_timer, &TIMEOUT_S)) {
         perror("Failed to add timeout event\n");
         return 1;
     }
 
-    // Add event that listens for signal SIGINT
-    struct event *event_sigint = evsignal_new(base, SIGINT, cb_sigint, (void*) base);
+    // Add events that listen for SIGINT and SIGTERM
+    struct event *event_sigint = evsignal_new(base, SIGINT, cb_shutdown, NULL);
+    event_priority_set(event_sigint, PRIO_CONTROL);
     if (evsignal_add(event_sigint, NULL)) {
         perror("Failed to add SIGINT event\n");
         return 1;
     }
-
-    // Add event that listens on a socket
-    evutil_socket_t listener = socket(AF_INET, SOCK_STREAM, 0);
-    if (listener == -1) {
-        perror("Failed to create listener socket\n");
+    struct event *event_sigterm = evsignal_new(base, SIGTERM, cb_shutdown, NULL);
+    event_priority_set(event_sigterm, PRIO_CONTROL);
+    if (evsignal_add(event_sigterm, NULL)) {
+        perror("Failed to add SIGTERM event\n");
         return 1;
     }
-    evutil_make_socket_nonblocking(listener);
-
-    int enabled = 1;
-    if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)) < 0) {
-        perror("Failed to set SO_REUSEADDR socket option\n");
+    struct event *event_sighup = evsignal_new(base, SIGHUP, cb_reload, event_timer);
+    event_priority_set(event_sighup, PRIO_CONTROL);
+    if (evsignal_add(event_sighup, NULL)) {
+        perror("Failed to add SIGHUP event\n");
         return 1;
     }
 
-    struct sockaddr_in sin88;
-    sin88.sin_family = AF_INET;
-    sin88.sin_addr.s_addr = 0; // listen on all interfaces
-    sin88.sin_port = htons(8888); // listen on :8888
+    // Serve metrics from the main thread's base too
+    struct evhttp *http = NULL;
+    if (config.admin_port > 0) {
+        http = evhttp_new(base);
+        if (!http || evhttp_bind_socket(http, "0.0.0.0", config.admin_port) < 0) {
+            perror("Failed to bind admin port\n");
+            return 1;
+        }
+        evhttp_set_cb(http, "/metrics", cb_metrics, NULL);
+    }
 
-    if (bind(listener, (struct sockaddr*) &sin88, sizeof(sin88)) < 0) {
-        perror("Failed to bind to :8888\n");
-        return 1;
+    log_msg(LOG_INFO, "Listening for events on %d%s thread(s):\n", config.num_threads,
+            config.num_cpus ? " pinned" : "");
+    for (int i = 0; i < config.num_raw_addrs; ++i) {
+        log_msg(LOG_INFO, "- Connections on %s - use nc to connect, type something and hit Enter\n",
+                config.raw_addrs[i].text);
+    }
+    for (int i = 0; i < config.num_lev_addrs; ++i) {
+        log_msg(LOG_INFO, "- Connections on %s (bufferevents%s%s)\n", config.lev_addrs[i].text,
+                ssl_ctx ? ", TLS" : "", acceptor ? ", acceptor thread" : "");
     }
+    log_msg(LOG_INFO, "- Timer every %ds\n"
+            "- SIGINT (Ctrl+C in terminal) or SIGTERM\n"
+            "- SIGHUP to reload the config\n", config.stats_interval_s);
 
-    int backlog_sz = 1;
-    if (listen(listener, backlog_sz) < 0) {
-        perror("Failed to listen on :8888\n");
+    // Pinned workers start out on their CPU
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    for (int i = 1; i < config.num_threads; ++i) {
+        if (workers[i].cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(workers[i].cpu, &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        if (pthread_create(&workers[i].thread, &attr, run_worker, &workers[i])) {
+            perror("Failed to create worker thread\n");
+            return 1;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    if (acceptor && pthread_create(&acceptor->thread, NULL, run_acceptor, NULL)) {
+        perror("Failed to create acceptor thread\n");
         return 1;
     }
-
-    struct event *event_listener = event_new(base, listener, EV_READ | EV_PERSIST,
-                                             cb_accept_conn, (void *)base);
-    if (event_add(event_listener, NULL)) {
-        perror("Failed to add socket listener event\n");
+    if (config.event_log && pthread_create(&event_log.thread, NULL, run_event_log, NULL)) {
+        perror("Failed to create event log thread\n");
         return 1;
     }
 
-    // Add an evconnlistener that listens on a different port
-    struct sockaddr_in sin77;
-    sin77.sin_family = AF_INET;
-    sin77.sin_addr.s_addr = 0; // listen on all interfaces
-    sin77.sin_port = htons(7777); // listen on :7777
-
-    struct evconnlistener *lev_listener = evconnlistener_new_bind(
-        base, cb_lev_accept, NULL, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE,
-        backlog_sz, (struct sockaddr*) &sin77, sizeof(sin77)
-    );
-    if (!lev_listener) {
-        perror("Failed to create lev listener\n");
+    if (workers[0].cpu >= 0 && pin_thread(pthread_self(), workers[0].cpu, NULL) < 0) {
         return 1;
     }
 
-    printf(
-        "Listening for events:\n"
-        "- Connections on :8888 - use 'nc localhost 8888', type something and hit Enter\n"
-        "- Connections on :7777 - use 'nc localhost 7777', type something and hit Enter\n"
-        "- Timer every 30s\n"
-        "- SIGINT (Ctrl+C in terminal)\n"
-    );
-
     // run loop forever as long as there are any events to listen for
-    event_base_dispatch(base);
+    run_worker(&workers[0]);
+
+    for (int i = 1; i < config.num_threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    if (acceptor) {
+        pthread_join(acceptor->thread, NULL);
+    }
+
+    // Every loop has finished, so everything can go
+    if (http) {
+        evhttp_free(http);
+    }
+    event_free(event_sighup);
+    event_free(event_sigterm);
+    event_free(event_sigint);
+    event_free(event_timer);
+    if (acceptor) {
+        free_acceptor();
+    }
+    for (int i = 0; i < config.num_threads; ++i) {
+        free_worker(&workers[i]);
+    }
+    // After the workers, so the connections they close still get logged
+    if (config.event_log) {
+        event_log_finish();
+    }
+    for (int i = 0; i < config.num_threads; ++i) {
+        free(workers[i].event_ring);
+    }
+    free(workers);
+    if (config.max_conns_per_ip > 0) {
+        ip_table_free();
+    }
+    if (conn_rate_cfg) {
+        ev_token_bucket_cfg_free(conn_rate_cfg);
+    }
+    if (group_rate_cfg) {
+        ev_token_bucket_cfg_free(group_rate_cfg);
+    }
+    if (ssl_ctx) {
+        SSL_CTX_free(ssl_ctx);
+    }
+    free(conn_limits);
+    free_config_texts(NULL);
+    libevent_global_shutdown();
 
+    log_msg(LOG_INFO, "Shut down cleanly\n");
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,27 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Static tracepoints in the "server" provider. When <sys/sdt.h> is around
+// (systemtap-sdt-dev) each one is a USDT probe: a single nop in the code plus
+// a note in the binary, which perf, bpftrace and friends can attach to in a
+// running process, e.g.
+//
+//   $ sudo bpftrace -e 'usdt:./main:server:read { @[arg0] = hist(arg2); }'
+//
+// Without it, or with -DNO_TRACE, they compile to nothing.
+#if !defined(NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_USDT 1
+#endif
+#endif
+
+#ifdef TRACE_USDT
+#define TRACE2(name, a, b) DTRACE_PROBE2(server, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(server, name, a, b, c)
+#else
+#define TRACE2(name, a, b) do {} while (0)
+#define TRACE3(name, a, b, c) do {} while (0)
+#endif
+
+#endif